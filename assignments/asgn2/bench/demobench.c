@@ -0,0 +1,449 @@
+/*
+ * demobench: The snakes and numbers demos without a terminal, as scheduler
+ *            throughput and fairness tests. The demos' threads do the same
+ *            work they always do (a snake moves, turns and bounces off the
+ *            edges, a hungry snake chases the food and grows when it gets
+ *            it, a number thread formats its line), and yield after every
+ *            move the same way, but nothing is drawn: each move is counted
+ *            instead, and there is no delay between them.
+ *
+ *              snakes   the 7 snakes of randomsnakes.c, colors 1 to 7
+ *              hungry   the 28 snakes of hungrysnakes.c, all starting at
+ *                       color 1 (each piece of food eaten adds one)
+ *              nums     the 5 threads of numbersmain.c
+ *
+ *            Each demo runs under each scheduler in turn until -m moves
+ *            have been made in all, or for -t seconds (1 by default). One
+ *            CSV row per run: demo, scheduler, threads, moves, ns, moves per
+ *            second, Jain's fairness index over the threads' moves (1 is
+ *            perfectly even, 1/threads is one thread getting everything),
+ *            and the fewest and most moves any thread made as a fraction of
+ *            an even share. -v also lists every thread's moves on stderr.
+ *
+ *            -d picks one demo, -s one scheduler: rr, mlfq, stride, edf,
+ *            zero (AlwaysZero), high (ChooseHighestColor), low
+ *            (ChooseLowestColor) or tstp (ChangeOnSIGTSTP, which only moves
+ *            on when sent a ^Z, so it isn't in the default list). -o writes
+ *            the CSV to a file.
+ *
+ * usage: demobench [-d demo] [-s sched] [-m moves] [-t seconds] [-v]
+ *                  [-o file]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "lwp.h"
+#include "snakes.h"
+#include "schedulers.h"
+#include "roundrobin.h"
+#include "mlfq.h"
+#include "stride.h"
+#include "edf.h"
+
+#define MAXSNAKES 100
+#define NUMTHREADS 5            // numbersmain.c's
+#define BOARD_COLS 80           // a standard terminal
+#define BOARD_LINES 24
+#define SNAKE_MAX_LEN 40        // hungry snakes stop growing here
+#define TURN_ODDS 8             // a snake turns on one move in this many
+#define CLOCK_EVERY 64          // moves between looks at the clock
+
+typedef struct sched_entry {
+  const char *name;
+  scheduler  *sched;            // (the schedulers are set at load time)
+  int         listed;           // run when no -s is given
+} sched_entry;
+
+static sched_entry scheds[] = {
+  { "rr",     &MyRoundRobin,       TRUE },
+  { "mlfq",   &MLFQ,               TRUE },
+  { "stride", &Stride,             TRUE },
+  { "edf",    &EDF,                TRUE },
+  { "zero",   &AlwaysZero,         TRUE },
+  { "high",   &ChooseHighestColor, TRUE },
+  { "low",    &ChooseLowestColor,  TRUE },
+  { "tstp",   &ChangeOnSIGTSTP,    FALSE },
+};
+#define NSCHEDS (sizeof(scheds) / sizeof(scheds[0]))
+
+static const char *demos[] = { "snakes", "hungry", "nums" };
+#define NDEMOS (sizeof(demos) / sizeof(demos[0]))
+
+// Where each direction moves a snake's head.
+static const int dir_dx[NUMDIRS] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+static const int dir_dy[NUMDIRS] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+
+static FILE *out;
+static int verbose = FALSE;
+
+// The current run: its threads' moves, and when to stop.
+static long moves[MAXSNAKES];
+static long total;
+static long move_limit;
+static long long deadline;
+static long long stopped_at;
+static volatile int stop;
+
+// The current run's snakes (for snakeFromLWpid()), and the food.
+static snake snakes[MAXSNAKES];
+static unsigned int seeds[MAXSNAKES];
+static int nsnakes;
+static sn_point food;
+static unsigned int food_seed;
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Counts a move (in place of drawing it), and ends the run if that was the
+// last one.
+static void count_move(int who) {
+  moves[who]++;
+  total++;
+
+  if (move_limit > 0 && total >= move_limit) {
+    stop = TRUE;
+  }
+  else if (deadline > 0 && total % CLOCK_EVERY == 0 && now_ns() >= deadline) {
+    stop = TRUE;
+  }
+
+  if (stop && stopped_at == 0) {
+    stopped_at = now_ns();
+  }
+}
+
+// === HEADLESS SNAKES =======================================================
+// The parts of snakes.h the demos use, on a board that is never drawn.
+
+snake new_snake(int y, int x, int len, int dir, int color) {
+  snake s = malloc(sizeof(struct snake_st));
+  if (s == NULL) {
+    perror("demobench: malloc");
+    exit(EXIT_FAILURE);
+  }
+  s->body = malloc(SNAKE_MAX_LEN * sizeof(sn_point));
+  if (s->body == NULL) {
+    perror("demobench: malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  // The body trails out behind the head.
+  int i;
+  for (i = 0; i < len; i++) {
+    s->body[i].x = x - i * dir_dx[dir];
+    s->body[i].y = y - i * dir_dy[dir];
+  }
+
+  s->dir = dir;
+  s->len = len;
+  s->color = color;
+  s->lw_pid = NO_THREAD;
+  s->others = NULL;
+  return s;
+}
+
+void free_snake(snake s) {
+  free(s->body);
+  free(s);
+}
+
+snake snakeFromLWpid(tid_t lw_pid) {
+  int i;
+  for (i = 0; i < nsnakes; i++) {
+    if (snakes[i]->lw_pid == lw_pid) {
+      return snakes[i];
+    }
+  }
+  return NULL;
+}
+
+// Says whether a point is on the board.
+static int on_board(int x, int y) {
+  return x >= 0 && x < BOARD_COLS && y >= 0 && y < BOARD_LINES;
+}
+
+// Points a hungry snake at the food.
+static direction toward_food(snake s) {
+  int dx = (food.x > s->body[0].x) - (food.x < s->body[0].x);
+  int dy = (food.y > s->body[0].y) - (food.y < s->body[0].y);
+  int d;
+  for (d = 0; d < NUMDIRS; d++) {
+    if (dir_dx[d] == dx && dir_dy[d] == dy) {
+      return d;
+    }
+  }
+  return s->dir;                // it's on the food
+}
+
+// Moves a snake one step: now and then it turns, and it turns away from
+// the edges. A hungry one heads for the food instead, and eats it if it gets
+// there.
+static void snake_step(snake s, unsigned int *seed, int hungry) {
+  if (hungry) {
+    s->dir = toward_food(s);
+  }
+  else if (rand_r(seed) % TURN_ODDS == 0) {
+    s->dir = rand_r(seed) % NUMDIRS;
+  }
+
+  int x = s->body[0].x + dir_dx[s->dir];
+  int y = s->body[0].y + dir_dy[s->dir];
+  while (!on_board(x, y)) {
+    s->dir = rand_r(seed) % NUMDIRS;
+    x = s->body[0].x + dir_dx[s->dir];
+    y = s->body[0].y + dir_dy[s->dir];
+  }
+
+  if (hungry && x == food.x && y == food.y) {
+    if (s->len < SNAKE_MAX_LEN) {
+      s->len++;
+    }
+    if (s->color < MAX_VISIBLE_SNAKE) {
+      s->color++;
+    }
+    food.x = rand_r(&food_seed) % BOARD_COLS;
+    food.y = rand_r(&food_seed) % BOARD_LINES;
+  }
+
+  memmove(s->body + 1, s->body, (s->len - 1) * sizeof(sn_point));
+  s->body[0].x = x;
+  s->body[0].y = y;
+}
+
+void run_snake(snake *s) {
+  int me = s - snakes;
+  while (!stop) {
+    snake_step(*s, &seeds[me], FALSE);
+    count_move(me);
+    lwp_yield();
+  }
+}
+
+void run_hungry_snake(snake *s) {
+  int me = s - snakes;
+  while (!stop) {
+    snake_step(*s, &seeds[me], TRUE);
+    count_move(me);
+    lwp_yield();
+  }
+}
+
+// numbersmain.c's indentnum(), formatting its line into a buffer instead of
+// printing it, and going until the run is over.
+static int indentnum(void *arg) {
+  int howfar = (int)(long)arg;
+  char line[64];
+  while (!stop) {
+    snprintf(line, sizeof(line), "%*d\n", howfar * 5, howfar);
+    count_move(howfar - 1);
+    lwp_yield();
+  }
+  return 0;
+}
+
+
+// === RUNS ==================================================================
+// Sets up a demo's threads the way its main() does.
+static int demo_setup(const char *demo) {
+  int cnt = 0, i;
+
+  if (strcmp(demo, "nums") == 0) {
+    for (i = 1; i <= NUMTHREADS; i++) {
+      lwp_create(indentnum, (void *)(long)i);
+    }
+    return NUMTHREADS;
+  }
+
+  if (strcmp(demo, "snakes") == 0) {
+    snakes[cnt++] = new_snake( 8,30,10, E,1);
+    snakes[cnt++] = new_snake(10,30,10, E,2);
+    snakes[cnt++] = new_snake(12,30,10, E,3);
+    snakes[cnt++] = new_snake( 8,50,10, W,4);
+    snakes[cnt++] = new_snake(10,50,10, W,5);
+    snakes[cnt++] = new_snake(12,50,10, W,6);
+    snakes[cnt++] = new_snake( 4,40,10, S,7);
+  }
+  else {
+    static const int hungry[][3] = {
+      { 8,30,E}, {10,30,E}, {10,50,W}, {12,50,W}, { 4,40,N}, {12,30,E},
+      { 8,50,W}, {10,50,W}, {12,50,W}, { 4,40,N}, {12,30,E}, { 8,50,W},
+      {10,50,W}, {12,50,W}, { 4,40,N}, {10,30,E}, {12,30,E}, {12,30,E},
+      { 8,50,W}, {10,50,W}, {12,50,W}, { 4,40,N}, {10,30,E}, {12,30,E},
+      { 8,50,W}, {10,50,W}, {12,50,W}, { 4,40,N},
+    };
+    for (i = 0; i < (int)(sizeof(hungry) / sizeof(hungry[0])); i++) {
+      snakes[cnt++] = new_snake(hungry[i][0], hungry[i][1], 10, hungry[i][2], 1);
+    }
+    food.x = BOARD_COLS / 2;
+    food.y = BOARD_LINES / 2;
+    food_seed = 1;
+  }
+  nsnakes = cnt;
+
+  lwpfun fun = (strcmp(demo, "snakes") == 0) ? (lwpfun)run_snake :
+    (lwpfun)run_hungry_snake;
+  for (i = 0; i < cnt; i++) {
+    seeds[i] = i + 1;
+    snakes[i]->lw_pid = lwp_create(fun, (void *)(snakes + i));
+  }
+  return cnt;
+}
+
+// Runs one demo under one scheduler and writes its row.
+static void run(const char *demo, sched_entry *e, double seconds) {
+  int i;
+
+  memset(moves, 0, sizeof(moves));
+  total = 0;
+  stop = FALSE;
+  stopped_at = 0;
+  nsnakes = 0;
+
+  lwp_set_scheduler(*e->sched);
+
+  long long start = now_ns();
+  deadline = (seconds > 0) ? start + (long long)(seconds * 1e9) : 0;
+  int n = demo_setup(demo);
+
+  for (i = 0; i < n; i++) {
+    lwp_wait(NULL);
+  }
+  if (stopped_at == 0) {
+    stopped_at = now_ns();
+  }
+  long long ns = stopped_at - start;
+
+  // Jain's index: (sum x)^2 / (n * sum x^2).
+  double sum = 0, sumsq = 0;
+  long lo = moves[0], hi = moves[0];
+  for (i = 0; i < n; i++) {
+    sum += moves[i];
+    sumsq += (double)moves[i] * moves[i];
+    if (moves[i] < lo) {
+      lo = moves[i];
+    }
+    if (moves[i] > hi) {
+      hi = moves[i];
+    }
+  }
+  double fair = sum / n;
+
+  fprintf(out, "%s,%s,%d,%ld,%lld,%.0f,%.3f,%.3f,%.3f\n", demo, e->name, n,
+      total, ns, ns ? total * 1e9 / ns : 0.0, sumsq ? sum * sum / (n * sumsq) : 0.0,
+      fair ? lo / fair : 0.0, fair ? hi / fair : 0.0);
+  fflush(out);
+
+  if (verbose) {
+    for (i = 0; i < n; i++) {
+      fprintf(stderr, "%s/%s: thread %d", demo, e->name, i);
+      if (i < nsnakes) {
+        fprintf(stderr, " (color %d)", snakes[i]->color);
+      }
+      fprintf(stderr, ": %ld moves\n", moves[i]);
+    }
+  }
+
+  for (i = 0; i < nsnakes; i++) {
+    free_snake(snakes[i]);
+  }
+  nsnakes = 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *demo = NULL;
+  const char *sched_name = NULL;
+  const char *path = NULL;
+  double seconds = -1;
+  unsigned int d, s;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      demo = argv[++i];
+    }
+    else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      sched_name = argv[++i];
+    }
+    else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      move_limit = atol(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      seconds = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-v") == 0) {
+      verbose = TRUE;
+    }
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      path = argv[++i];
+    }
+    else {
+      fprintf(stderr, "usage: %s [-d demo] [-s sched] [-m moves] "
+          "[-t seconds] [-v] [-o file]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // A move limit alone runs as long as it takes.
+  if (seconds < 0) {
+    seconds = (move_limit > 0) ? 0 : 1;
+  }
+
+  for (d = 0; demo != NULL && d < NDEMOS; d++) {
+    if (strcmp(demo, demos[d]) == 0) {
+      break;
+    }
+  }
+  if (d == NDEMOS) {
+    fprintf(stderr, "%s: unknown demo %s (snakes, hungry, nums)\n", argv[0],
+        demo);
+    exit(EXIT_FAILURE);
+  }
+
+  for (s = 0; sched_name != NULL && s < NSCHEDS; s++) {
+    if (strcmp(sched_name, scheds[s].name) == 0) {
+      break;
+    }
+  }
+  if (s == NSCHEDS) {
+    fprintf(stderr, "%s: unknown scheduler %s (rr, mlfq, stride, edf, zero, "
+        "high, low, tstp)\n", argv[0], sched_name);
+    exit(EXIT_FAILURE);
+  }
+
+  out = stdout;
+  if (path != NULL) {
+    out = fopen(path, "w");
+    if (out == NULL) {
+      perror(path);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // The original thread becomes an LWP, and sits out each run in lwp_wait().
+  lwp_start();
+
+  fprintf(out, "demo,sched,threads,moves,ns,moves_per_sec,jain,min_share,"
+      "max_share\n");
+  for (d = 0; d < NDEMOS; d++) {
+    if (demo != NULL && strcmp(demo, demos[d]) != 0) {
+      continue;
+    }
+    for (s = 0; s < NSCHEDS; s++) {
+      if (sched_name != NULL ? strcmp(sched_name, scheds[s].name) != 0 :
+          !scheds[s].listed) {
+        continue;
+      }
+      run(demos[d], &scheds[s], seconds);
+    }
+  }
+
+  if (out != stdout) {
+    fclose(out);
+  }
+  return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * edf_frames: Runs periodic LWPs under the EDF scheduler, the way the snakes
+ *             demos move every snake once a frame: each thread does a fixed
+ *             amount of work per period, then waits for the next one. At the
+ *             end, every thread's deadline misses and lateness histogram are
+ *             printed, so the number of threads a frame budget can carry can
+ *             be read off by running it with more and more threads.
+ *
+ *             Thread i's period is the base period times (1 + i % 3), so
+ *             their deadlines interleave. With -p the threads are also
+ *             preempted (which EDF only acts on between jobs anyway).
+ *
+ * usage: edf_frames [-p] [threads] [period_ms] [work_us] [frames]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "lwp.h"
+#include "edf.h"
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_PERIOD_MS 10
+#define DEFAULT_WORK_US 1000
+#define DEFAULT_FRAMES 200
+#define MAX_THREADS 1024
+#define QUANTUM_USEC 1000
+
+static long work_us = DEFAULT_WORK_US;
+static long frames = DEFAULT_FRAMES;
+static tid_t tids[MAX_THREADS];
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int mover(void *arg) {
+  long f;
+  for (f = 0; f < frames; f++) {
+    long long until = now_ns() + work_us * 1000LL;
+    while (now_ns() < until) {
+      ;
+    }
+    edf_next_period();
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  long args[4] = { DEFAULT_THREADS, DEFAULT_PERIOD_MS, DEFAULT_WORK_US,
+    DEFAULT_FRAMES };
+  int nargs = 0, preempt = FALSE, i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-p") == 0) {
+      preempt = TRUE;
+    }
+    else if (argv[i][0] != '-' && nargs < 4) {
+      args[nargs++] = atol(argv[i]);
+    }
+    else {
+      fprintf(stderr, "usage: %s [-p] [threads] [period_ms] [work_us] "
+          "[frames]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  int nthreads = (int)args[0];
+  long period_ms = args[1];
+  work_us = args[2];
+  frames = args[3];
+  if (nthreads < 1 || nthreads > MAX_THREADS || period_ms < 1) {
+    fprintf(stderr, "%s: 1 to %d threads, period at least 1ms\n", argv[0],
+        MAX_THREADS);
+    exit(EXIT_FAILURE);
+  }
+
+  lwp_set_scheduler(EDF);
+  if (preempt) {
+    lwp_set_quantum(QUANTUM_USEC);
+  }
+
+  double load = 0;
+  for (i = 0; i < nthreads; i++) {
+    long long period = period_ms * 1000000LL * (1 + i % 3);
+    tids[i] = lwp_create(mover, NULL);
+    edf_set_period(tids[i], period, 0);
+    load += work_us * 1000.0 / (double)period;
+  }
+
+  lwp_start();
+  for (i = 0; i < nthreads; i++) {
+    lwp_wait(NULL);
+  }
+
+  long long jobs = 0, misses = 0;
+  edf_stats s;
+  for (i = 0; i < nthreads; i++) {
+    if (edf_get_stats(tids[i], &s) == 0) {
+      jobs += s.jobs;
+      misses += s.misses;
+    }
+  }
+
+  edf_print_stats(stdout);
+  printf("%s%s: %d threads, load %.2f: %lld jobs, %lld missed (%.1f%%)\n",
+      argv[0], preempt ? " -p" : "", nthreads, load, jobs, misses,
+      jobs ? 100.0 * misses / (double)jobs : 0.0);
+
+  return 0;
+}
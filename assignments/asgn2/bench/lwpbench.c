@@ -0,0 +1,598 @@
+/*
+ * lwpbench: A headless benchmark suite for the LWP library. Every result is
+ *           a CSV row, so runs with different schedulers (or a changed
+ *           switch) can be put side by side:
+ *
+ *             pingpong  two threads lwp_yield() back and forth
+ *             handoff   two threads lwp_yield_to() each other, with 100
+ *                       other threads runnable the whole time
+ *             ring      N threads lwp_yield() round the pool, N from 10 up to
+ *                       the -n limit (100000 by default)
+ *             churn     lwp_create() -> lwp_exit() -> lwp_wait(), one thread
+ *                       at a time and in batches (churn_many: the batches
+ *                       made by lwp_create_many())
+ *             pool      the same empty functions run as lwp_pool_submit()
+ *                       tasks on a few workers, in batches
+ *             gen       lwp_gen_next() into a generator that just yields
+ *             chan      one thread lwp_chan_send()s ints to another over an
+ *                       unbuffered channel
+ *             future    one thread lwp_future_complete()s futures another is
+ *                       waiting on in lwp_future_get()
+ *             migrate   lwp_set_scheduler() back and forth with N runnable
+ *                       threads
+ *             workers   WORKERS_THREADS threads each doing a little work
+ *                       between lwp_yield()s, on 1, 2, 4 and (if more) as
+ *                       many workers as there are CPUs (see
+ *                       lwp_set_workers()); the threads column is the
+ *                       workers, and past one the scheduler is WorkStealing
+ *             memory    resident and virtual memory per (started) thread
+ *
+ *           Columns: bench, scheduler, threads, ops, total ns, ns per op,
+ *           and for memory, bytes per thread (resident, then virtual).
+ *
+ *           -s picks the scheduler (rr, mlfq, stride or edf), -n the most
+ *           threads any bench makes, -k the stack size in KiB (RLIMIT_STACK
+ *           by default), -g makes stacks growable from that many KiB (see
+ *           lwp_set_stack_growth()), and -o a file for the CSV instead of
+ *           stdout.
+ *
+ * usage: lwpbench [-s sched] [-n threads] [-k stack_kb] [-g initial_kb]
+ *                 [-o file]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "lwp.h"
+#include "roundrobin.h"
+#include "mlfq.h"
+#include "stride.h"
+#include "edf.h"
+#include "lwppool.h"
+#include "lwpgen.h"
+#include "lwpchan.h"
+#include "lwpfuture.h"
+
+#define DEFAULT_MAX_THREADS 100000
+#define PINGPONG_ROUNDS 1000000
+#define HANDOFF_BYSTANDERS 100
+#define RING_SWITCHES 1000000   // per ring size, roughly
+#define RING_MIN_ROUNDS 10
+#define CHURN_THREADS 100000
+#define CHURN_BATCH 1000
+#define POOL_TASKS 1000000
+#define POOL_WORKERS 4
+#define GEN_VALUES 1000000
+#define CHAN_MESSAGES 1000000
+#define FUTURES 100000
+#define MIGRATIONS 100
+#define WORKERS_THREADS 64
+#define WORKERS_ROUNDS 20000
+#define WORKERS_SPIN 200        // loop iterations of "work" per yield
+
+static FILE *out;
+static const char *sched_name = "rr";
+
+// How many times each thread in a bench yields.
+static long rounds;
+
+// Threads that have started and parked.
+static thread *parked;
+static long started;
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void row(const char *bench, long threads, long ops, long long ns) {
+  fprintf(out, "%s,%s,%ld,%ld,%lld,%.1f,,\n", bench, sched_name, threads,
+      ops, ns, ops ? (double)ns / (double)ops : 0.0);
+  fflush(out);
+}
+
+// Yields `rounds` times.
+static int yielder(void *arg) {
+  long i;
+  for (i = 0; i < rounds; i++) {
+    lwp_yield();
+  }
+  return 0;
+}
+
+// The two threads in handoff, when the first of them finished, and whether
+// the bystanders can go.
+static tid_t pair[2];
+static long long handoff_end;
+static volatile int handoff_done;
+
+// Hands the CPU to the other one of the pair `rounds` times.
+static int handoff(void *arg) {
+  tid_t other = pair[1 - (long)arg];
+  long i;
+  for (i = 0; i < rounds; i++) {
+    lwp_yield_to(other);
+  }
+
+  // The other one's last lwp_yield_to() finds us gone, and it falls back on
+  // lwp_yield(): a fair scheduler then lets the bystanders catch up on all
+  // the time the pair took, which isn't part of the handoff.
+  if (handoff_end == 0) {
+    handoff_end = now_ns();
+  }
+  return 0;
+}
+
+// Yields until handoff is done.
+static int bystander(void *arg) {
+  while (!handoff_done) {
+    lwp_yield();
+  }
+  return 0;
+}
+
+// Does a little work, then yields, `rounds` times.
+static int cruncher(void *arg) {
+  volatile unsigned long x = 0;
+  long i;
+  int j;
+  for (i = 0; i < rounds; i++) {
+    for (j = 0; j < WORKERS_SPIN; j++) {
+      x += j;
+    }
+    lwp_yield();
+  }
+  return 0;
+}
+
+// Exits straight away.
+static int quitter(void *arg) {
+  return 0;
+}
+
+// Checks in and parks until it is let go.
+static int waiter(void *arg) {
+  parked[started++] = lwp_self();
+  lwp_park();
+  return 0;
+}
+
+// Creates n threads running fun, or bails.
+static void spawn(long n, lwpfun fun) {
+  long i;
+  for (i = 0; i < n; i++) {
+    if (lwp_create(fun, NULL) == NO_THREAD) {
+      fprintf(stderr, "lwpbench: lwp_create() failed after %ld threads\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+// Waits for n threads to exit.
+static void reap(long n) {
+  long i;
+  for (i = 0; i < n; i++) {
+    lwp_wait(NULL);
+  }
+}
+
+// Yields until n waiter()s have checked in.
+static void gather(long n) {
+  parked = malloc(n * sizeof(thread));
+  if (parked == NULL) {
+    perror("lwpbench: malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  started = 0;
+  while (started < n) {
+    lwp_yield();
+  }
+}
+
+// Lets the waiter()s go and waits for them.
+static void dismiss(long n) {
+  long i;
+  for (i = 0; i < n; i++) {
+    lwp_unpark(parked[i]);
+  }
+  reap(n);
+
+  free(parked);
+  parked = NULL;
+}
+
+// Reads our size and resident set, in bytes.
+static void memory(long long *virt, long long *rss) {
+  long pages_virt = 0, pages_rss = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f != NULL) {
+    if (fscanf(f, "%ld %ld", &pages_virt, &pages_rss) != 2) {
+      pages_virt = pages_rss = 0;
+    }
+    fclose(f);
+  }
+
+  long page = sysconf(_SC_PAGE_SIZE);
+  *virt = (long long)pages_virt * page;
+  *rss = (long long)pages_rss * page;
+}
+
+static void bench_pingpong(void) {
+  rounds = PINGPONG_ROUNDS;
+  spawn(2, yielder);
+
+  long long start = now_ns();
+  reap(2);
+  row("pingpong", 2, 2 * rounds, now_ns() - start);
+}
+
+static void bench_handoff(void) {
+  rounds = PINGPONG_ROUNDS;
+  handoff_done = FALSE;
+  handoff_end = 0;
+  spawn(HANDOFF_BYSTANDERS, bystander);
+  pair[0] = lwp_create(handoff, (void *)0);
+  pair[1] = lwp_create(handoff, (void *)1);
+
+  long long start = now_ns();
+  lwp_join(pair[0], NULL);
+  lwp_join(pair[1], NULL);
+  long long elapsed = handoff_end - start;
+
+  handoff_done = TRUE;
+  reap(HANDOFF_BYSTANDERS);
+  row("handoff", 2 + HANDOFF_BYSTANDERS, 2 * rounds, elapsed);
+}
+
+static void bench_ring(long max) {
+  long n;
+  for (n = 10; n <= max; n *= 10) {
+    rounds = RING_SWITCHES / n;
+    if (rounds < RING_MIN_ROUNDS) {
+      rounds = RING_MIN_ROUNDS;
+    }
+    spawn(n, yielder);
+
+    long long start = now_ns();
+    reap(n);
+    row("ring", n, n * rounds, now_ns() - start);
+  }
+}
+
+static void bench_churn(long max) {
+  long total = (CHURN_THREADS < max) ? CHURN_THREADS : max;
+  long batches[2] = { 1, (CHURN_BATCH < max) ? CHURN_BATCH : max };
+  int b;
+
+  for (b = 0; b < 2; b++) {
+    long done = 0;
+    long long start = now_ns();
+    while (done < total) {
+      spawn(batches[b], quitter);
+      reap(batches[b]);
+      done += batches[b];
+    }
+    row("churn", batches[b], done, now_ns() - start);
+  }
+
+  // The batches again, with lwp_create_many().
+  long done = 0;
+  long long start = now_ns();
+  while (done < total) {
+    if (lwp_create_many(quitter, NULL, batches[1], NULL) == -1) {
+      fprintf(stderr, "lwpbench: lwp_create_many() failed\n");
+      exit(EXIT_FAILURE);
+    }
+    reap(batches[1]);
+    done += batches[1];
+  }
+  row("churn_many", batches[1], done, now_ns() - start);
+}
+
+static void bench_pool(void) {
+  static lwp_task *tasks[CHURN_BATCH];
+  long done = 0;
+  int i;
+
+  lwp_pool_create(POOL_WORKERS);
+
+  long long start = now_ns();
+  while (done < POOL_TASKS) {
+    for (i = 0; i < CHURN_BATCH; i++) {
+      tasks[i] = lwp_pool_submit(quitter, NULL);
+    }
+    for (i = 0; i < CHURN_BATCH; i++) {
+      lwp_pool_wait(tasks[i]);
+    }
+    done += CHURN_BATCH;
+  }
+  row("pool", POOL_WORKERS, done, now_ns() - start);
+
+  lwp_pool_destroy();
+}
+
+// Yields GEN_VALUES values.
+static void counter(void *arg) {
+  long i;
+  for (i = 0; i < GEN_VALUES; i++) {
+    lwp_gen_yield((void *)i);
+  }
+}
+
+static void bench_gen(void) {
+  lwp_gen *gen = lwp_gen_create(counter, NULL, 0);
+  if (gen == NULL) {
+    exit(EXIT_FAILURE);
+  }
+
+  long n = 0;
+  void *value;
+  long long start = now_ns();
+  while (lwp_gen_next(gen, &value)) {
+    n++;
+  }
+  row("gen", 1, n, now_ns() - start);
+
+  lwp_gen_destroy(gen);
+}
+
+// Sends CHAN_MESSAGES ints, then closes the channel.
+static int sender(void *arg) {
+  lwp_chan *chan = arg;
+  int i;
+  for (i = 0; i < CHAN_MESSAGES; i++) {
+    lwp_chan_send(chan, &i);
+  }
+  lwp_chan_close(chan);
+  return 0;
+}
+
+static void bench_chan(void) {
+  lwp_chan *chan = lwp_chan_create(sizeof(int), 0);
+  if (chan == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  lwp_create(sender, chan);
+
+  long n = 0;
+  int value;
+  long long start = now_ns();
+  while (lwp_chan_recv(chan, &value)) {
+    n++;
+  }
+  row("chan", 2, n, now_ns() - start);
+
+  reap(1);
+  lwp_chan_destroy(chan);
+}
+
+// Completes each future in turn, yielding after each one so the getter
+// parks on the next.
+static int completer(void *arg) {
+  lwp_future **futures = arg;
+  long i;
+  for (i = 0; i < FUTURES; i++) {
+    lwp_future_complete(futures[i], (void *)i);
+    lwp_yield();
+  }
+  return 0;
+}
+
+static void bench_future(void) {
+  lwp_future **futures = malloc(FUTURES * sizeof(lwp_future *));
+  if (futures == NULL) {
+    perror("lwpbench: malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  long i;
+  for (i = 0; i < FUTURES; i++) {
+    futures[i] = lwp_future_create();
+    if (futures[i] == NULL) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  lwp_create(completer, futures);
+
+  void *value;
+  long long start = now_ns();
+  for (i = 0; i < FUTURES; i++) {
+    lwp_future_get(futures[i], &value);
+  }
+  row("future", 2, FUTURES, now_ns() - start);
+
+  reap(1);
+  for (i = 0; i < FUTURES; i++) {
+    lwp_future_destroy(futures[i]);
+  }
+  free(futures);
+}
+
+static void bench_migrate(long max, scheduler sched) {
+  // Back and forth between ours and some other one.
+  scheduler other = (sched == MyRoundRobin) ? MLFQ : MyRoundRobin;
+  long n;
+  int i;
+
+  // Threads that haven't run yet, so they are all in the pool.
+  rounds = 0;
+  for (n = 10; n <= max; n *= 10) {
+    spawn(n, yielder);
+
+    long long start = now_ns();
+    for (i = 0; i < MIGRATIONS; i++) {
+      lwp_set_scheduler((i % 2 == 0) ? other : sched);
+    }
+    long long elapsed = now_ns() - start;
+    lwp_set_scheduler(sched);
+
+    row("migrate", n, MIGRATIONS, elapsed);
+    reap(n);
+  }
+}
+
+// The M:N rows. lwp_start() only returns once every thread is done, and
+// nobody is left to lwp_wait() for them, so they are detached. This runs
+// before the original thread becomes an LWP; the one-worker row is run
+// later, the usual way.
+static void bench_workers_mn(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  long counts[3] = { 2, 4, cpus };
+  const char *name = sched_name;
+  int i, j;
+
+  rounds = WORKERS_ROUNDS;
+  sched_name = "ws";
+  for (i = 0; i < 3; i++) {
+    if (counts[i] < 2 || (i == 2 && counts[i] <= 4)) {
+      continue;
+    }
+
+    for (j = 0; j < WORKERS_THREADS; j++) {
+      tid_t tid = lwp_create(cruncher, NULL);
+      if (tid == NO_THREAD) {
+        exit(EXIT_FAILURE);
+      }
+      lwp_detach(tid);
+    }
+
+    lwp_set_workers((int)counts[i]);
+    long long start = now_ns();
+    lwp_start();
+    row("workers", counts[i], WORKERS_THREADS * rounds, now_ns() - start);
+  }
+  lwp_set_workers(1);
+  sched_name = name;
+}
+
+static void bench_workers(void) {
+  rounds = WORKERS_ROUNDS;
+  spawn(WORKERS_THREADS, cruncher);
+
+  long long start = now_ns();
+  reap(WORKERS_THREADS);
+  row("workers", 1, WORKERS_THREADS * rounds, now_ns() - start);
+}
+
+static void bench_memory(long max) {
+  long n;
+  for (n = 10; n <= max; n *= 10) {
+    long long virt0, rss0, virt1, rss1;
+    memory(&virt0, &rss0);
+
+    spawn(n, waiter);
+    gather(n);
+    memory(&virt1, &rss1);
+
+    fprintf(out, "memory,%s,%ld,%ld,,,%lld,%lld\n", sched_name, n, n,
+        (rss1 - rss0) / n, (virt1 - virt0) / n);
+    fflush(out);
+    dismiss(n);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  long max = DEFAULT_MAX_THREADS;
+  long stack_kb = 0;
+  long grow_kb = 0;
+  const char *path = NULL;
+  scheduler sched = MyRoundRobin;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      sched_name = argv[++i];
+    }
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      max = atol(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+      stack_kb = atol(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+      grow_kb = atol(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      path = argv[++i];
+    }
+    else {
+      fprintf(stderr, "usage: %s [-s sched] [-n threads] [-k stack_kb] "
+          "[-g initial_kb] [-o file]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (strcmp(sched_name, "rr") == 0) {
+    sched = MyRoundRobin;
+  }
+  else if (strcmp(sched_name, "mlfq") == 0) {
+    sched = MLFQ;
+  }
+  else if (strcmp(sched_name, "stride") == 0) {
+    sched = Stride;
+  }
+  else if (strcmp(sched_name, "edf") == 0) {
+    sched = EDF;
+  }
+  else {
+    fprintf(stderr, "%s: unknown scheduler %s (rr, mlfq, stride, edf)\n",
+        argv[0], sched_name);
+    exit(EXIT_FAILURE);
+  }
+
+  // The library sizes every stack by RLIMIT_STACK.
+  if (stack_kb > 0) {
+    struct rlimit rlim;
+    getrlimit(RLIMIT_STACK, &rlim);
+    rlim.rlim_cur = (rlim_t)stack_kb * 1024;
+    if (setrlimit(RLIMIT_STACK, &rlim) == -1) {
+      perror("lwpbench: setrlimit");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (grow_kb > 0 && lwp_set_stack_growth((size_t)grow_kb * 1024) == -1) {
+    exit(EXIT_FAILURE);
+  }
+
+  out = stdout;
+  if (path != NULL) {
+    out = fopen(path, "w");
+    if (out == NULL) {
+      perror(path);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // The M:N rows first, while the original thread is not an LWP yet.
+  fprintf(out, "bench,sched,threads,ops,ns,ns_per_op,rss_per_thread,"
+      "virt_per_thread\n");
+  bench_workers_mn();
+
+  // The original thread becomes an LWP, and sits out each bench in
+  // lwp_wait() (or takes part, for the ones that need it to look around).
+  lwp_set_scheduler(sched);
+  lwp_start();
+
+  bench_workers();
+  bench_pingpong();
+  bench_handoff();
+  bench_ring(max);
+  bench_churn(max);
+  bench_pool();
+  bench_gen();
+  bench_chan();
+  bench_future();
+  bench_migrate(max, sched);
+  bench_memory(max);
+
+  if (out != stdout) {
+    fclose(out);
+  }
+  return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * pingpong: Two LWPs hand the CPU back and forth with lwp_yield() and the
+ *           average cost of one switch is reported.
+ *
+ *           The Makefile links this twice: pingpong uses the callee-saved
+ *           only switch, and pingpong_full uses a library built with
+ *           -DLWP_FULL_SWITCH (every register and the FPU control words on
+ *           every switch), so the two can be compared.
+ *
+ * usage: pingpong [rounds]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "lwp.h"
+
+#define DEFAULT_ROUNDS 1000000
+
+static long rounds = DEFAULT_ROUNDS;
+
+static int player(void *arg) {
+  long i;
+  for (i = 0; i < rounds; i++) {
+    lwp_yield();
+  }
+  return 0;
+}
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 2) {
+    fprintf(stderr, "usage: %s [rounds]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (argc == 2) {
+    rounds = atol(argv[1]);
+  }
+
+  lwp_create(player, NULL);
+  lwp_create(player, NULL);
+
+  // The original thread joins the ring until it blocks in lwp_wait(), after
+  // which only the two players are left bouncing.
+  long long start = now_ns();
+  lwp_start();
+  lwp_wait(NULL);
+  lwp_wait(NULL);
+  long long elapsed = now_ns() - start;
+
+  long switches = 2 * rounds;
+  printf("%s: %ld switches, %.1f ns/switch\n",
+      argv[0], switches, (double)elapsed / (double)switches);
+
+  return 0;
+}
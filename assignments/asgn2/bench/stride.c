@@ -0,0 +1,127 @@
+/*
+ * stride_ratio: Runs a few CPU-bound LWPs under the Stride scheduler, each
+ *               with its own number of tickets, and reports the share of
+ *               the CPU each one actually got next to the share its tickets
+ *               ask for.
+ *
+ *               Each thread does small chunks of work until time is up,
+ *               yielding after every chunk, and adds up how long its chunks
+ *               took. With -p it doesn't yield, and is left to preemption;
+ *               then it counts the time between one look at the clock and
+ *               the next, unless that gap is long enough that it must have
+ *               been switched out in between.
+ *
+ * usage: stride_ratio [-p] [seconds] [tickets ...]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "lwp.h"
+#include "stride.h"
+
+#define DEFAULT_SECONDS 2
+#define MAX_THREADS 16
+#define CHUNK 2000              // loop iterations per chunk (a few us)
+#define QUANTUM_USEC 1000
+#define SWITCHED_NS 200000      // a gap this long means we were switched out
+
+static long long deadline;
+static int preempt = FALSE;
+
+static long long ran[MAX_THREADS];
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int worker(void *arg) {
+  long long *mine = arg;
+  volatile unsigned long sink = 0;
+  long i;
+
+  long long last = now_ns();
+  while (last < deadline) {
+    for (i = 0; i < CHUNK; i++) {
+      sink += i ^ (sink >> 3);
+    }
+
+    long long now = now_ns();
+    if (!preempt || now - last < SWITCHED_NS) {
+      *mine += now - last;
+    }
+
+    if (!preempt) {
+      lwp_yield();
+      now = now_ns();
+    }
+    last = now;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned int tickets[MAX_THREADS];
+  int nthreads = 0, seconds = 0, i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-p") == 0) {
+      preempt = TRUE;
+    }
+    else if (argv[i][0] != '-' && seconds == 0) {
+      seconds = atoi(argv[i]);
+    }
+    else if (argv[i][0] != '-' && nthreads < MAX_THREADS) {
+      tickets[nthreads++] = (unsigned int)atoi(argv[i]);
+    }
+    else {
+      fprintf(stderr, "usage: %s [-p] [seconds] [tickets ...]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (seconds <= 0) {
+    seconds = DEFAULT_SECONDS;
+  }
+  if (nthreads == 0) {
+    tickets[nthreads++] = 70;
+    tickets[nthreads++] = 20;
+    tickets[nthreads++] = 10;
+  }
+
+  lwp_set_scheduler(Stride);
+  if (preempt) {
+    lwp_set_quantum(QUANTUM_USEC);
+  }
+
+  long total_tickets = 0;
+  for (i = 0; i < nthreads; i++) {
+    tid_t tid = lwp_create(worker, &ran[i]);
+    stride_set_tickets(tid, tickets[i]);
+    total_tickets += tickets[i];
+  }
+
+  deadline = now_ns() + (long long)seconds * 1000000000LL;
+  lwp_start();
+  for (i = 0; i < nthreads; i++) {
+    lwp_wait(NULL);
+  }
+
+  long long total_ran = 0;
+  for (i = 0; i < nthreads; i++) {
+    total_ran += ran[i];
+  }
+
+  printf("%s%s: %d threads, %.3fs of work in %ds\n", argv[0],
+      preempt ? " -p" : "", nthreads, total_ran / 1e9, seconds);
+  for (i = 0; i < nthreads; i++) {
+    double want = 100.0 * tickets[i] / (double)total_tickets;
+    double got = total_ran ? 100.0 * ran[i] / (double)total_ran : 0;
+    printf("  tickets %6u: expected %5.1f%%, achieved %5.1f%%\n",
+        tickets[i], want, got);
+  }
+
+  return 0;
+}
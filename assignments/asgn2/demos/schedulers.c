@@ -0,0 +1,332 @@
+#include <stddef.h>
+#include <signal.h>
+#include <stdio.h>
+#include "lwp.h"
+#include "snakes.h"
+#include "schedulers.h"
+
+// === MACROS ================================================================
+// The scheduler's links in the thread struct: a circular doubly linked list,
+// in the order the threads were admitted.
+#define NEXT sched_one
+#define PREV sched_two
+
+// What the color schedulers take a thread that isn't a snake to be (the
+// number demos, or the main thread): the least wanted color either way.
+#define NO_COLOR_HIGH 0
+#define NO_COLOR_LOW (MAX_VISIBLE_SNAKE + 2)
+
+
+// === DATA DEFINITIONS ======================================================
+// One scheduler's pool.
+typedef struct pool {
+  thread head;                  // the oldest thread
+  thread last;                  // the one next() picked last (or NULL)
+  int    count;
+} pool;
+
+
+// === HELPER FUCNTIONS ======================================================
+// Adds a thread to the back of a pool.
+static void pool_admit(pool *p, thread new);
+// Takes a thread out of a pool.
+static void pool_remove(pool *p, thread victim);
+// Picks the thread with the highest (or lowest) color, round robin among
+// those of that color.
+static thread pool_by_color(pool *p, int highest);
+// A thread's snake color (or what stands in for it).
+static int color_of(thread t, int highest);
+// Counts SIGTSTPs for ChangeOnSIGTSTP.
+static void tstp_handler(int signum);
+
+static void zero_admit(thread new);
+static void zero_remove(thread victim);
+static thread zero_next(void);
+static int zero_qlen(void);
+
+static void tstp_init(void);
+static void tstp_admit(thread new);
+static void tstp_remove(thread victim);
+static thread tstp_next(void);
+static int tstp_qlen(void);
+static void tstp_picked(thread next);
+
+static void high_admit(thread new);
+static void high_remove(thread victim);
+static thread high_next(void);
+static int high_qlen(void);
+static void high_picked(thread next);
+
+static void low_admit(thread new);
+static void low_remove(thread victim);
+static thread low_next(void);
+static int low_qlen(void);
+static void low_picked(thread next);
+
+
+// === GLOBAL VARIABLES ======================================================
+static struct scheduler zero_publish = {
+  .init=NULL,
+  .shutdown=NULL,
+  .admit=zero_admit,
+  .remove=zero_remove,
+  .next=zero_next,
+  .qlen=zero_qlen
+};
+
+static struct scheduler tstp_publish = {
+  .init=tstp_init,
+  .shutdown=NULL,
+  .admit=tstp_admit,
+  .remove=tstp_remove,
+  .next=tstp_next,
+  .qlen=tstp_qlen,
+  .picked=tstp_picked
+};
+
+static struct scheduler high_publish = {
+  .init=NULL,
+  .shutdown=NULL,
+  .admit=high_admit,
+  .remove=high_remove,
+  .next=high_next,
+  .qlen=high_qlen,
+  .picked=high_picked
+};
+
+static struct scheduler low_publish = {
+  .init=NULL,
+  .shutdown=NULL,
+  .admit=low_admit,
+  .remove=low_remove,
+  .next=low_next,
+  .qlen=low_qlen,
+  .picked=low_picked
+};
+
+scheduler AlwaysZero = &zero_publish;
+scheduler ChangeOnSIGTSTP = &tstp_publish;
+scheduler ChooseHighestColor = &high_publish;
+scheduler ChooseLowestColor = &low_publish;
+
+static pool zero_pool;
+static pool tstp_pool;
+static pool high_pool;
+static pool low_pool;
+
+// SIGTSTPs received, and how many ChangeOnSIGTSTP has acted on.
+static volatile sig_atomic_t tstp_count = 0;
+static sig_atomic_t tstp_seen = 0;
+
+
+// === ALWAYSZERO ============================================================
+// Always runs the oldest thread in the pool. Nothing else runs until it
+// blocks or exits.
+static void zero_admit(thread new) {
+  pool_admit(&zero_pool, new);
+}
+
+static void zero_remove(thread victim) {
+  pool_remove(&zero_pool, victim);
+}
+
+static thread zero_next(void) {
+  return zero_pool.head;
+}
+
+static int zero_qlen(void) {
+  return zero_pool.count;
+}
+
+
+// === CHANGEONSIGTSTP =======================================================
+// Keeps running the same thread, and moves on to the next one (in the order
+// they were admitted) each time a SIGTSTP (^Z) comes in.
+static void tstp_init(void) {
+  struct sigaction sa;
+  sa.sa_handler = tstp_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+
+  if (sigaction(SIGTSTP, &sa, NULL) == -1) {
+    perror("[tstp_init] Error when installing the SIGTSTP handler.");
+  }
+}
+
+static void tstp_admit(thread new) {
+  pool_admit(&tstp_pool, new);
+}
+
+static void tstp_remove(thread victim) {
+  // The one after the running thread takes over from it.
+  int running = (victim == tstp_pool.last);
+  thread after = victim->NEXT;
+
+  pool_remove(&tstp_pool, victim);
+  if (running && tstp_pool.head != NULL) {
+    tstp_pool.last = after;
+  }
+}
+
+static thread tstp_next(void) {
+  if (tstp_pool.head == NULL) {
+    return NULL;
+  }
+
+  if (tstp_pool.last == NULL) {
+    tstp_pool.last = tstp_pool.head;
+  }
+  else if (tstp_seen != tstp_count) {
+    tstp_seen = tstp_count;
+    tstp_pool.last = tstp_pool.last->NEXT;
+  }
+  return tstp_pool.last;
+}
+
+static int tstp_qlen(void) {
+  return tstp_pool.count;
+}
+
+static void tstp_picked(thread next) {
+  tstp_pool.last = next;
+}
+
+
+// === CHOOSEHIGHESTCOLOR / CHOOSELOWESTCOLOR ================================
+// Runs the snakes with the highest (lowest) color, round robin among them.
+// Everybody else waits until no snake of that color is runnable.
+static void high_admit(thread new) {
+  pool_admit(&high_pool, new);
+}
+
+static void high_remove(thread victim) {
+  pool_remove(&high_pool, victim);
+}
+
+static thread high_next(void) {
+  return pool_by_color(&high_pool, TRUE);
+}
+
+static int high_qlen(void) {
+  return high_pool.count;
+}
+
+static void high_picked(thread next) {
+  high_pool.last = next;
+}
+
+static void low_admit(thread new) {
+  pool_admit(&low_pool, new);
+}
+
+static void low_remove(thread victim) {
+  pool_remove(&low_pool, victim);
+}
+
+static thread low_next(void) {
+  return pool_by_color(&low_pool, FALSE);
+}
+
+static int low_qlen(void) {
+  return low_pool.count;
+}
+
+static void low_picked(thread next) {
+  low_pool.last = next;
+}
+
+
+// === HELPER FUNCTIONS ======================================================
+// Adds a thread to the back of a pool.
+// @param p The pool.
+// @param new The thread.
+// @return void.
+static void pool_admit(pool *p, thread new) {
+  p->count++;
+
+  if (p->head == NULL) {
+    new->NEXT = new;
+    new->PREV = new;
+    p->head = new;
+    return;
+  }
+
+  thread tail = p->head->PREV;
+  new->NEXT = p->head;
+  new->PREV = tail;
+  tail->NEXT = new;
+  p->head->PREV = new;
+}
+
+// Takes a thread out of a pool. If it was the last one picked, the one after
+// it takes its place, so rotations carry on from there.
+// @param p The pool.
+// @param victim The thread.
+// @return void.
+static void pool_remove(pool *p, thread victim) {
+  p->count--;
+
+  if (victim->NEXT == victim) {
+    p->head = NULL;
+    p->last = NULL;
+  }
+  else {
+    if (victim == p->head) {
+      p->head = victim->NEXT;
+    }
+    if (victim == p->last) {
+      p->last = victim->PREV;
+    }
+    victim->PREV->NEXT = victim->NEXT;
+    victim->NEXT->PREV = victim->PREV;
+  }
+
+  victim->NEXT = NULL;
+  victim->PREV = NULL;
+}
+
+// Looks round the pool, starting after the thread picked last, for the
+// first thread with the highest (or lowest) color.
+// @param p The pool.
+// @param highest TRUE for the highest color, FALSE for the lowest.
+// @return The thread, or NULL if the pool is empty.
+static thread pool_by_color(pool *p, int highest) {
+  if (p->head == NULL) {
+    return NULL;
+  }
+
+  thread start = (p->last != NULL) ? p->last->NEXT : p->head;
+  thread best = start;
+  int best_color = color_of(start, highest);
+
+  thread t;
+  for (t = start->NEXT; t != start; t = t->NEXT) {
+    int color = color_of(t, highest);
+    if (highest ? (color > best_color) : (color < best_color)) {
+      best = t;
+      best_color = color;
+    }
+  }
+
+  p->last = best;
+  return best;
+}
+
+// Finds a thread's snake and its color.
+// @param t The thread.
+// @param highest Which way the scheduler asking sorts.
+// @return The color, or the least wanted one if it isn't a snake.
+static int color_of(thread t, int highest) {
+  snake s = snakeFromLWpid(t->tid);
+  if (s == NULL) {
+    return highest ? NO_COLOR_HIGH : NO_COLOR_LOW;
+  }
+  return s->color;
+}
+
+// Counts a SIGTSTP.
+// @param signum Unused.
+// @return void.
+static void tstp_handler(int signum) {
+  tstp_count++;
+}
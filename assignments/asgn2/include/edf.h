@@ -0,0 +1,49 @@
+#ifndef EDF_SCHED
+#define EDF_SCHED
+
+#include <stdio.h>
+#include "lwp.h"
+
+// An earliest-deadline-first scheduler for periodic (frame-driven) threads.
+// A thread given a period with edf_set_period() releases a job every period,
+// each due some time after its release, and calls edf_next_period() when it
+// finishes one. next() picks the runnable thread whose current job is due
+// soonest (from a pairing heap threaded through sched_one and sched_two).
+// Threads with no period run, round robin, only when no periodic thread can.
+// A job that finishes after its deadline is a miss: each thread's misses and
+// how late they were are kept, even after the thread exits.
+extern scheduler EDF;
+
+// Lateness histogram: bucket 0 is under 1us late, bucket i (> 0) is from
+// 2^(i-1)us up to 2^i us, and the last bucket takes everything later.
+#define EDF_HIST_BUCKETS 20
+
+typedef struct edf_stats {
+  tid_t     tid;
+  long long period;                 // ns
+  long long deadline;               // ns after each release
+  long long jobs;                   // finished
+  long long misses;                 // finished late
+  long long max_late;               // ns, worst miss
+  long long late_hist[EDF_HIST_BUCKETS];
+} edf_stats;
+
+// Makes a thread periodic: its first job is released now, and every job is
+// due deadline_ns after its release (deadline_ns <= 0 means at the end of its
+// period). Works on a thread that is already running, and on one another
+// scheduler has (it takes effect once EDF is installed). Returns 0, or -1 if
+// there is no such thread or the period isn't positive.
+extern int edf_set_period(tid_t tid, long long period_ns, long long deadline_ns);
+
+// Ends the calling thread's current job (counting a miss if it is late) and
+// waits for the next release. If that has already passed, the next job
+// starts straight away. Just yields for threads with no period, or when EDF
+// isn't the scheduler.
+extern void edf_next_period(void);
+
+// Copies out a thread's stats. Returns 0, or -1 if it was never periodic.
+extern int edf_get_stats(tid_t tid, edf_stats *out);
+
+// Prints every periodic thread's stats (including ones that have exited).
+extern void edf_print_stats(FILE *out);
+#endif
@@ -0,0 +1,65 @@
+#ifndef LWPCHAN
+#define LWPCHAN
+
+#include <stddef.h>
+#include "lwp.h"
+
+// Bounded channels. A channel carries fixed-size elements (copied in and
+// out), and holds up to capacity of them; with a capacity of 0 every send
+// waits for a receiver (a rendezvous). A thread that has to wait is parked on
+// the channel, not spinning, and whoever lets it go does its copy for it: a
+// send to a parked receiver copies straight into the receiver's element and
+// wakes it, so the receiver never touches the buffer. Waiters are served
+// oldest first. Single worker only.
+
+typedef struct lwp_chan lwp_chan;
+
+// What a select case does.
+#define LWP_CHAN_SEND 0
+#define LWP_CHAN_RECV 1
+
+// One case of a select.
+typedef struct lwp_chan_op lwp_chan_op;
+struct lwp_chan_op {
+  lwp_chan *chan;
+  int       dir;                // LWP_CHAN_SEND or LWP_CHAN_RECV
+  void     *elem;               // what to send, or where to receive into
+  int       ok;                 // set: FALSE if the channel was closed
+
+  // The rest is for the library's own use (a select's case, parked on its
+  // channel).
+  lwp_chan_op *next;
+  lwp_chan_op *prev;
+  int          queued;
+  struct chan_select *select;
+};
+
+// Makes a channel for elements of elem_size bytes that holds up to capacity
+// of them. Returns NULL if there is no memory.
+extern lwp_chan *lwp_chan_create(size_t elem_size, size_t capacity);
+
+// Frees a channel. Nobody may be waiting on it.
+extern void      lwp_chan_destroy(lwp_chan *chan);
+
+// Closes a channel: sends fail from now on, and receives fail once what is
+// buffered has been taken. Everybody waiting on it is woken (and fails).
+extern void      lwp_chan_close(lwp_chan *chan);
+
+// Sends a copy of *elem, parking until there is room (or a receiver).
+// Returns TRUE, or FALSE if the channel is closed.
+extern int       lwp_chan_send(lwp_chan *chan, const void *elem);
+
+// Receives into *elem, parking until there is something to receive. Returns
+// TRUE, or FALSE if the channel is closed and empty.
+extern int       lwp_chan_recv(lwp_chan *chan, void *elem);
+
+// The same, but never park. They return FALSE if they would have (or if the
+// channel is closed).
+extern int       lwp_chan_try_send(lwp_chan *chan, const void *elem);
+extern int       lwp_chan_try_recv(lwp_chan *chan, void *elem);
+
+// Waits until one of n cases can go ahead, does it, and returns its index.
+// Its ok says whether it worked (FALSE if its channel was closed). When more
+// than one is ready at once, they take turns being first.
+extern int       lwp_chan_select(lwp_chan_op *ops, int n);
+#endif
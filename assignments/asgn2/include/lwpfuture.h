@@ -0,0 +1,43 @@
+#ifndef LWPFUTURE
+#define LWPFUTURE
+
+#include "lwp.h"
+
+// Futures: a slot for a result that isn't there yet. A producer completes one
+// once, with a value or an error; consumers either wait for it in
+// lwp_future_get() (parked, like the threads waiting in lwpsync.h, so waiting
+// costs no CPU) or hang continuations on it that run when it completes,
+// without a thread waiting at all. A continuation can complete other futures,
+// which is how results are chained. Single worker only.
+
+typedef struct lwp_future lwp_future;
+
+// A continuation. It gets the completed future (so lwp_future_get() on it
+// returns at once) and the argument it was registered with.
+typedef void (*lwp_future_fn)(lwp_future *future, void *arg);
+
+// Makes a future that hasn't completed. Returns NULL if there is no memory.
+extern lwp_future *lwp_future_create(void);
+
+// Frees a future. Nobody may be waiting on it; continuations that haven't
+// run never will.
+extern void        lwp_future_destroy(lwp_future *future);
+
+// Completes a future with a value, or fails it with an error (which must not
+// be 0). Everybody waiting is woken, then the continuations run on the
+// calling LWP, oldest first. Returns 0, or -1 if it had already completed.
+extern int         lwp_future_complete(lwp_future *future, void *value);
+extern int         lwp_future_fail(lwp_future *future, int error);
+
+// Waits (parking the calling LWP) until a future completes. Returns 0 with
+// its value in *value (if value isn't NULL), or the error it failed with.
+extern int         lwp_future_get(lwp_future *future, void **value);
+
+// Says whether a future has completed.
+extern int         lwp_future_ready(lwp_future *future);
+
+// Has fn(future, arg) run when a future completes, or right now (on the
+// calling LWP) if it already has. Returns 0, or -1 if there is no memory.
+extern int         lwp_future_then(lwp_future *future, lwp_future_fn fn,
+                                   void *arg);
+#endif
@@ -0,0 +1,46 @@
+#ifndef LWPGEN
+#define LWPGEN
+
+#include <stddef.h>
+#include "lwp.h"
+
+// Generators: a function on a stack of its own that hands values back to
+// whoever resumes it. lwp_gen_next() switches straight into the generator and
+// lwp_gen_yield() straight back out (swap_rfiles_fast(), callee-saved
+// registers only), without the scheduler or the library's lists, so a resume
+// costs about as much as a function call or two and never allocates. A
+// generator belongs to the LWP (or plain thread) that resumes it; it may call
+// anything an LWP may, including lwp_yield(), and generators may resume other
+// generators.
+
+typedef void (*lwp_genfun)(void *arg);
+
+typedef struct lwp_gen lwp_gen;
+
+// Stack size when lwp_gen_create() is given 0.
+#define LWP_GEN_STACK_DEFAULT (64 * 1024)
+
+// Makes a generator that will run fun(arg) on a stack of the given size
+// (rounded up to pages), with a guard page under it. Nothing runs until the
+// first lwp_gen_next(). Returns NULL if the stack can't be mapped.
+extern lwp_gen *lwp_gen_create(lwp_genfun fun, void *arg, size_t stack);
+
+// Resumes a generator until it yields or returns. Returns TRUE with what it
+// yielded in *value (if value isn't NULL), or FALSE once it has returned.
+extern int      lwp_gen_next(lwp_gen *gen, void **value);
+
+// Hands a value to whoever resumed the running generator, and waits to be
+// resumed again. Only a generator may call it.
+extern void     lwp_gen_yield(void *value);
+
+// Says whether a generator has returned.
+extern int      lwp_gen_done(lwp_gen *gen);
+
+// Starts a generator over with a new function and argument, on the stack it
+// already has. It must not be running.
+extern void     lwp_gen_reset(lwp_gen *gen, lwp_genfun fun, void *arg);
+
+// Frees a generator (and its stack). It must not be running; if it hasn't
+// returned, it is simply dropped, mid-function.
+extern void     lwp_gen_destroy(lwp_gen *gen);
+#endif
@@ -0,0 +1,22 @@
+#ifndef LWPIO
+#define LWPIO
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "lwp.h"
+
+// Blocking I/O for LWPs. Each call puts the fd in non-blocking mode, and
+// when it would block, parks the calling LWP on an epoll interest list until
+// the fd is ready, so only that LWP waits. When every LWP is parked, the
+// scheduler sleeps in epoll_wait(). These behave like read(), write(),
+// accept() and connect() otherwise (including -1 and errno on failure).
+extern ssize_t lwp_read(int fd, void *buf, size_t count);
+extern ssize_t lwp_write(int fd, const void *buf, size_t count);
+extern int     lwp_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+extern int     lwp_connect(int fd, const struct sockaddr *addr,
+                           socklen_t addrlen);
+
+// Closes an fd used with the calls above, and forgets what we knew about it
+// (so the number can safely be reused).
+extern int     lwp_close(int fd);
+#endif
@@ -0,0 +1,33 @@
+#ifndef LWPPOOL
+#define LWPPOOL
+
+#include "lwp.h"
+
+// A task pool: a fixed set of long-lived worker LWPs that run submitted
+// functions off a FIFO queue, so a short piece of work costs a queue push and
+// pop instead of a stack, a context and a switch into a new thread. An idle
+// worker waits on a semaphore (see lwpsync.h), so it costs no CPU, and a busy
+// one keeps taking tasks without switching. There is one pool. Single worker
+// only.
+
+// A submitted task. It belongs to the pool until lwp_pool_wait() returns.
+typedef struct lwp_task lwp_task;
+
+// Starts n worker LWPs (detached, so lwp_wait() never sees them). Can be
+// called before lwp_start(). Returns 0, or -1 if there already is a pool or
+// the workers can't be created.
+extern int       lwp_pool_create(int n);
+
+// Queues fun(arg) to run on a worker. Returns its handle, which must be
+// passed to lwp_pool_wait() exactly once, or NULL if there is no pool (or no
+// memory).
+extern lwp_task *lwp_pool_submit(lwpfun fun, void *arg);
+
+// Waits for a task to finish (parking the calling LWP if it hasn't), frees
+// it, and returns what its function returned.
+extern int       lwp_pool_wait(lwp_task *task);
+
+// Lets the workers finish whatever is queued and waits for them to exit. A
+// new pool can be created afterwards.
+extern void      lwp_pool_destroy(void);
+#endif
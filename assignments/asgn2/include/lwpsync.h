@@ -0,0 +1,68 @@
+#ifndef LWPSYNC
+#define LWPSYNC
+
+#include "lwp.h"
+
+// Blocking primitives for LWPs. A thread that has to wait is taken out of the
+// scheduler and queued on the primitive, and is admitted again (oldest first)
+// when it is its turn, so waiting costs no CPU. Ownership is handed straight
+// to the woken thread: nobody can barge in between. Single worker only.
+//
+// The timed variants give up after ns nanoseconds (see lwptimer.h) and return
+// FALSE; they return TRUE if they got what they were waiting for. A condition
+// wait that times out still returns with the mutex held.
+
+// A queue of parked threads (linked through wait_next).
+typedef struct lwp_waitq {
+  thread head;
+  thread tail;
+} lwp_waitq;
+
+typedef struct lwp_mutex {
+  thread    owner;              // NULL when unlocked
+  lwp_waitq waiters;
+} lwp_mutex;
+
+typedef struct lwp_cond {
+  lwp_mutex *mutex;             // the mutex the waiters hold
+  lwp_waitq  waiters;
+} lwp_cond;
+
+typedef struct lwp_sem {
+  unsigned int count;
+  lwp_waitq    waiters;
+} lwp_sem;
+
+typedef struct lwp_barrier {
+  unsigned int count;           // how many threads make up a round
+  unsigned int arrived;
+  lwp_waitq    waiters;
+} lwp_barrier;
+
+#define LWP_MUTEX_INITIALIZER { NULL, { NULL, NULL } }
+#define LWP_COND_INITIALIZER  { NULL, { NULL, NULL } }
+
+// What lwp_barrier_wait() returns to the last thread of a round.
+#define LWP_BARRIER_SERIAL 1
+
+extern void lwp_mutex_init(lwp_mutex *m);
+extern void lwp_mutex_lock(lwp_mutex *m);
+extern int  lwp_mutex_trylock(lwp_mutex *m);
+extern int  lwp_mutex_timedlock(lwp_mutex *m, long long ns);
+extern void lwp_mutex_unlock(lwp_mutex *m);
+
+extern void lwp_cond_init(lwp_cond *c);
+extern void lwp_cond_wait(lwp_cond *c, lwp_mutex *m);
+extern int  lwp_cond_timedwait(lwp_cond *c, lwp_mutex *m, long long ns);
+extern void lwp_cond_signal(lwp_cond *c);
+extern void lwp_cond_broadcast(lwp_cond *c);
+
+extern void lwp_sem_init(lwp_sem *s, unsigned int count);
+extern void lwp_sem_wait(lwp_sem *s);
+extern int  lwp_sem_trywait(lwp_sem *s);
+extern int  lwp_sem_timedwait(lwp_sem *s, long long ns);
+extern void lwp_sem_post(lwp_sem *s);
+
+extern void lwp_barrier_init(lwp_barrier *b, unsigned int count);
+extern int  lwp_barrier_wait(lwp_barrier *b);
+#endif
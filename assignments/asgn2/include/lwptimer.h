@@ -0,0 +1,46 @@
+#ifndef LWPTIMER
+#define LWPTIMER
+
+#include "lwp.h"
+
+// Sleeping for LWPs. A sleeping LWP is parked, and a hierarchical timer
+// wheel admits it again once its time is up (checked on every scheduling
+// decision). When every LWP is waiting, the process sleeps in the kernel
+// until the next timer is due. Single worker only.
+
+// Parks the calling LWP for at least ns nanoseconds.
+extern void lwp_sleep(long long ns);
+
+// The monotonic clock the timers run on, in nanoseconds.
+extern long long lwp_now(void);
+
+
+// The rest is for the library's own use (timed waits and the scheduler).
+
+// A timer. It lives wherever its owner puts it (usually the stack of the
+// thread waiting on it), and fire() is called from the scheduler when it
+// expires.
+typedef struct lwp_timer {
+  long long deadline;               // lwp_now() at which it fires
+  void (*fire)(struct lwp_timer *t);
+  struct lwp_timer *next;           // links in a wheel slot
+  struct lwp_timer *prev;
+  int pending;                      // on the wheel
+  int level;                        // where, while pending
+  int slot;
+} lwp_timer;
+
+// Arms a timer to call t->fire once lwp_now() reaches deadline.
+extern void lwp_timer_add(lwp_timer *t, long long deadline);
+
+// Disarms a timer. Harmless if it already fired.
+extern void lwp_timer_cancel(lwp_timer *t);
+
+// Fires every timer that is due, and says how many that was. Cheap when none
+// are armed.
+extern int lwp_timer_expire(void);
+
+// How long until the next timer might be due (0 if one is due now), or -1 if
+// none are armed. It may be early, never late.
+extern long long lwp_timer_wait_ns(void);
+#endif
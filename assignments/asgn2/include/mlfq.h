@@ -0,0 +1,14 @@
+#ifndef MLFQ_SCHED
+#define MLFQ_SCHED
+
+#include "lwp.h"
+
+// A multi-level feedback queue. Threads start at the top level and are
+// demoted once they have used up a level's CPU allotment (whether in one go
+// or across many short runs), so threads that mostly wait, like I/O
+// handlers, stay on top and are picked first. Every so often every thread is
+// boosted back to the top, so nothing starves. Each level is a FIFO, and a
+// bitmap of the non-empty levels makes admit(), remove(), next() and qlen()
+// all O(1). Lower levels get longer slices under preemption (quantum()).
+extern scheduler MLFQ;
+#endif
@@ -0,0 +1,26 @@
+#ifndef PAIRHEAP
+#define PAIRHEAP
+
+#include "lwp.h"
+
+// A pairing heap of threads, for the schedulers that pick by a key (Stride
+// and EDF). It is threaded through sched_one (a thread's leftmost child),
+// sched_two (its next sibling) and sched_data[PH_PREV] (its parent if it is a
+// leftmost child, else its left sibling), so a scheduler using it has the
+// other three sched_data slots to itself. Inserting is O(1), and taking any
+// thread out is O(log n) amortized.
+
+// The sched_data slot the heap keeps its back links in.
+#define PH_PREV 3
+
+typedef struct ph_heap {
+  thread root;                      // the thread that comes out first
+  int  (*before)(thread a, thread b); // TRUE if a comes out ahead of b
+} ph_heap;
+
+// Puts a thread in the heap.
+extern void ph_insert(ph_heap *heap, thread t);
+
+// Takes a thread out of the heap, wherever it is.
+extern void ph_delete(ph_heap *heap, thread t);
+#endif
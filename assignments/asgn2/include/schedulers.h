@@ -2,6 +2,10 @@
 #define SCHEDULERSH
 
 #include <lwp.h>
+
+// The demo schedulers (demos/schedulers.c). The color ones look each thread
+// up with snakeFromLWpid(), so they need the snakes library (or the headless
+// one in bench/demobench.c) linked in.
 extern scheduler AlwaysZero;
 extern scheduler ChangeOnSIGTSTP;
 extern scheduler ChooseHighestColor;
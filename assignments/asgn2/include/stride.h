@@ -0,0 +1,26 @@
+#ifndef STRIDE_SCHED
+#define STRIDE_SCHED
+
+#include "lwp.h"
+
+// A stride (proportional-share) scheduler. Each thread holds some tickets,
+// and gets CPU time in proportion to them: every nanosecond a thread runs
+// moves its pass on by STRIDE_ONE / tickets, and next() picks the thread with
+// the smallest pass. The pool is a pairing heap threaded through sched_one
+// and sched_two, so next() is O(log n) (amortized) and admit() is O(1).
+// Threads that block keep their place relative to the others when they come
+// back, rather than catching up on the time they missed.
+extern scheduler Stride;
+
+// What a thread's tickets are divided into. It is also the most tickets a
+// thread can hold.
+#define STRIDE_ONE (1 << 16)
+
+// Threads start with this many tickets.
+#define STRIDE_DEFAULT_TICKETS 100
+
+// Sets how many tickets a thread holds (from 1 to STRIDE_ONE). Takes effect
+// the next time it is charged, and holds even while another scheduler has
+// it. Returns 0, or -1 if there is no such thread.
+extern int stride_set_tickets(tid_t tid, unsigned int tickets);
+#endif
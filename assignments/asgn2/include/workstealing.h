@@ -0,0 +1,25 @@
+#ifndef WORKSTEALING
+#define WORKSTEALING
+
+#include "lwp.h"
+
+// The M:N scheduler. Every worker pthread owns a deque of runnable threads,
+// and an idle worker steals from the others. The deques are laid out like
+// Chase-Lev's (the owner pushes at the bottom, thieves take from the top),
+// but without its pop from the bottom: the owner takes from the top too, so
+// each worker runs its threads FIFO, and a thread that yields goes behind
+// the others instead of straight back on. admit() and next() act on the
+// deque of whichever worker calls them, so the same callbacks are shared by
+// every worker.
+extern scheduler WorkStealing;
+
+// Allocates one deque per worker. Must be called before WorkStealing is
+// handed to lwp_set_scheduler().
+extern void ws_setup(int nworkers);
+
+// Binds the calling pthread to the deque with the given index.
+extern void ws_bind(int id);
+
+// Releases the deques (and any arrays retired while growing them).
+extern void ws_teardown(void);
+#endif
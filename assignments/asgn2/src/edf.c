@@ -0,0 +1,459 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "edf.h"
+#include "lwptimer.h"
+#include "pairheap.h"
+
+// === MACROS ================================================================
+// Threads with no period wait in a FIFO (periodic ones are in a pairing
+// heap, which has sched_one, sched_two and PH_PREV while they are in it).
+#define NEXT sched_one
+#define PREV sched_two
+
+// What we keep in each thread's sched_data.
+#define EDF_TAG   0             // this install's tag once we've set it up
+#define EDF_TASK  1             // its edf_task, or NULL if it has no period
+#define EDF_WHERE 2             // which of the pools it is in
+
+#define EDF_OUT  0
+#define EDF_FIFO 1
+#define EDF_HEAP 2
+
+// A thread's edf_task.
+#define TASK(t) ((edf_task *)(intptr_t)(t)->sched_data[EDF_TASK])
+
+
+// === DATA DEFINITIONS ======================================================
+// Everything we know about a periodic thread. These are never freed, so the
+// stats can be read after the thread exits.
+typedef struct edf_task {
+  edf_stats stats;
+  long long release;                // of the current job
+  long long due;                    // the current job's absolute deadline
+  long long key;                    // due, as of when it was admitted
+  struct edf_task *next_task;       // every task, newest first
+} edf_task;
+
+
+// === HELPER FUNCTIONS ======================================================
+// Gives this install its own tag.
+static void edf_init(void);
+// Adds a thread to the heap (or FIFO).
+static void edf_admit(thread new);
+// Removes a thread from the heap (or FIFO).
+static void edf_remove(thread victim);
+// Gets the thread whose job is due first.
+static thread edf_next(void);
+// The number of threads in the pool.
+static int edf_qlen(void);
+// Carries on from a thread lwp_yield_to() picked.
+static void edf_picked(thread next);
+// Sets up sched_data for a thread we haven't seen yet.
+static void edf_claim(thread t);
+// Finds the task kept for a thread id.
+static edf_task *edf_find(tid_t tid);
+// Counts a finished job against its deadline.
+static void edf_account(edf_task *task, long long now);
+// Appends a thread to the FIFO.
+static void fifo_push(thread t);
+// Takes a thread out of the FIFO.
+static void fifo_unlink(thread t);
+// Orders the heap by deadline.
+static int edf_before(thread a, thread b);
+
+
+// === GLOBAL VARIABLES ======================================================
+// The actual struct that holds all of the pointers to the functions.
+static struct scheduler edf_publish = {
+  .init=edf_init,
+  .shutdown=NULL,
+  .admit=edf_admit,
+  .remove=edf_remove,
+  .next=edf_next,
+  .qlen=edf_qlen,
+  .quantum=NULL,
+  .picked=edf_picked
+};
+
+// The global EDF pointer that will be referenced.
+scheduler EDF = &edf_publish;
+
+// What marks a thread's sched_data as set up by this install: our address,
+// with how many times we have been installed above the bits a pointer uses.
+static long long tag = 0;
+static long long installs = 0;
+
+// The heap of periodic threads, the FIFO of the rest, and how many there are
+// in both.
+static ph_heap heap = { NULL, edf_before };
+static thread head = NULL;
+static thread tail = NULL;
+static int count = 0;
+
+// Every thread that has ever been given a period.
+static edf_task *tasks = NULL;
+
+
+// === SCHEDULER FUNCTIONS ===================================================
+// Called by lwp_set_scheduler() before the threads are moved over. Whatever
+// a thread had in sched_data from an earlier install may have been written
+// over since, so a new tag makes edf_claim() set every thread up afresh.
+// @param void.
+// @return void.
+static void edf_init(void) {
+  installs++;
+  tag = (installs << 48) | (long long)(intptr_t)&edf_publish;
+}
+
+// Adds a periodic thread to the heap, keyed on its current job's deadline,
+// and anybody else to the back of the FIFO.
+// @param new The new thread that is going to be added to the pool.
+// @return void.
+static void edf_admit(thread new) {
+  edf_claim(new);
+
+  edf_task *task = TASK(new);
+  if (task != NULL) {
+    task->key = task->due;
+    ph_insert(&heap, new);
+    new->sched_data[EDF_WHERE] = EDF_HEAP;
+  }
+  else {
+    fifo_push(new);
+    new->sched_data[EDF_WHERE] = EDF_FIFO;
+  }
+
+  count++;
+}
+
+// Takes a thread out of whichever pool it is in.
+// @param victim The thread we are removing from the schedulers pool.
+// @return void.
+static void edf_remove(thread victim) {
+  if (victim->sched_data[EDF_WHERE] == EDF_HEAP) {
+    ph_delete(&heap, victim);
+  }
+  else {
+    fifo_unlink(victim);
+  }
+
+  victim->sched_data[EDF_WHERE] = EDF_OUT;
+  count--;
+}
+
+// Picks the periodic thread whose job is due first. It stays in the heap, so
+// under preemption it keeps running until it finishes its job or blocks. If
+// no periodic thread is runnable, the threads with no period take turns.
+// @param void.
+// @return thread The next thread to run, or NULL if the pool is empty.
+static thread edf_next(void) {
+  if (heap.root != NULL) {
+    return heap.root;
+  }
+
+  thread next = head;
+  if (next != NULL && next->NEXT != NULL) {
+    fifo_unlink(next);
+    fifo_push(next);
+  }
+
+  return next;
+}
+
+// Return the number of runnable threads.
+// @param void.
+// @return int The number of threads in our scheduling pool.
+static int edf_qlen(void) {
+  return count;
+}
+
+// A thread was run out of turn (by lwp_yield_to()). Deadlines don't care who
+// ran when, but a thread without a period has had its turn, so it goes to the
+// back of the FIFO.
+// @param next The thread being run.
+// @return void.
+static void edf_picked(thread next) {
+  if (next->sched_data[EDF_WHERE] == EDF_FIFO && next->NEXT != NULL) {
+    fifo_unlink(next);
+    fifo_push(next);
+  }
+}
+
+
+// === PERIOD FUNCTIONS ======================================================
+// Makes a thread periodic, with its first job released now. A thread that
+// is already in the pool is moved into the heap. One that another scheduler
+// has (so sched_data is its) only gets its task, which edf_claim() finds
+// when it is admitted.
+// @param tid The thread.
+// @param period_ns How often it releases a job.
+// @param deadline_ns How long after a release each job is due (<= 0 means
+//   the period).
+// @return 0, or -1 if there is no such thread or period_ns isn't positive.
+int edf_set_period(tid_t tid, long long period_ns, long long deadline_ns) {
+  thread t = tid2thread(tid);
+  if (t == NULL || period_ns <= 0) {
+    return -1;
+  }
+  if (deadline_ns <= 0) {
+    deadline_ns = period_ns;
+  }
+
+  lwp_preempt_disable();
+  int ours = (lwp_get_scheduler() == EDF && t->sched_data[EDF_TAG] == tag);
+
+  edf_task *task = edf_find(tid);
+  if (task == NULL) {
+    task = calloc(1, sizeof(edf_task));
+    if (task == NULL) {
+      perror("[edf_set_period] Error when calling calloc()");
+      exit(EXIT_FAILURE);
+    }
+    task->stats.tid = tid;
+    task->next_task = tasks;
+    tasks = task;
+  }
+
+  task->stats.period = period_ns;
+  task->stats.deadline = deadline_ns;
+  task->release = lwp_now();
+  task->due = task->release + deadline_ns;
+
+  // Re-admit it so it is keyed on the new deadline.
+  if (ours && t->sched_data[EDF_WHERE] != EDF_OUT) {
+    edf_remove(t);
+    t->sched_data[EDF_TASK] = (long long)(intptr_t)task;
+    edf_admit(t);
+  }
+  else if (ours) {
+    t->sched_data[EDF_TASK] = (long long)(intptr_t)task;
+  }
+
+  lwp_preempt_enable();
+  return 0;
+}
+
+// Ends the calling thread's job and waits for its next release. Under any
+// other scheduler it just yields.
+// @param void.
+// @return void.
+void edf_next_period(void) {
+  thread self = lwp_self();
+
+  if (lwp_get_scheduler() != EDF) {
+    lwp_yield();
+    return;
+  }
+
+  lwp_preempt_disable();
+  edf_claim(self);
+
+  edf_task *task = TASK(self);
+  if (task == NULL) {
+    lwp_preempt_enable();
+    lwp_yield();
+    return;
+  }
+
+  long long now = lwp_now();
+  edf_account(task, now);
+
+  // Releases stay on the period's grid, so a thread that falls behind
+  // catches up (and its misses show it) rather than drifting.
+  task->release += task->stats.period;
+  task->due = task->release + task->stats.deadline;
+
+  if (task->release > now) {
+    // lwp_sleep() re-admits us, keyed on the new deadline.
+    lwp_sleep(task->release - now);
+  }
+  else {
+    // Already released: go back in on the new deadline, behind anything
+    // due sooner.
+    if (self->sched_data[EDF_WHERE] == EDF_HEAP) {
+      edf_remove(self);
+      edf_admit(self);
+    }
+    lwp_yield();
+  }
+
+  lwp_preempt_enable();
+}
+
+
+// === STATS FUNCTIONS =======================================================
+// Copies out a thread's stats.
+// @param tid The thread.
+// @param out Where to put them.
+// @return 0, or -1 if it was never given a period.
+int edf_get_stats(tid_t tid, edf_stats *out) {
+  lwp_preempt_disable();
+  edf_task *task = edf_find(tid);
+  if (task != NULL) {
+    *out = task->stats;
+  }
+  lwp_preempt_enable();
+
+  return (task != NULL) ? 0 : -1;
+}
+
+// Prints a line per periodic thread, oldest first, followed by the non-empty
+// buckets of its lateness histogram.
+// @param out Where to print.
+// @return void.
+void edf_print_stats(FILE *out) {
+  edf_task *task;
+  edf_task *order = NULL;
+  int i;
+
+  lwp_preempt_disable();
+
+  // The list is newest first; turn it around to print in creation order.
+  for (task = tasks; task != NULL; task = tasks) {
+    tasks = task->next_task;
+    task->next_task = order;
+    order = task;
+  }
+
+  for (task = order; task != NULL; task = task->next_task) {
+    edf_stats *s = &task->stats;
+    fprintf(out, "tid %lu: period %.3fms deadline %.3fms: %lld jobs, "
+        "%lld missed (%.1f%%), worst %.3fms late\n", s->tid,
+        s->period / 1e6, s->deadline / 1e6, s->jobs, s->misses,
+        s->jobs ? 100.0 * s->misses / (double)s->jobs : 0.0,
+        s->max_late / 1e6);
+
+    for (i = 0; i < EDF_HIST_BUCKETS; i++) {
+      if (s->late_hist[i] == 0) {
+        continue;
+      }
+      if (i == 0) {
+        fprintf(out, "    < 1us late: %lld\n", s->late_hist[i]);
+      }
+      else if (i == EDF_HIST_BUCKETS - 1) {
+        fprintf(out, "    >= %lldus late: %lld\n", 1LL << (i - 1),
+            s->late_hist[i]);
+      }
+      else {
+        fprintf(out, "    %lld-%lldus late: %lld\n", 1LL << (i - 1),
+            (1LL << i) - 1, s->late_hist[i]);
+      }
+    }
+  }
+
+  // Put it back.
+  for (task = order; task != NULL; task = order) {
+    order = task->next_task;
+    task->next_task = tasks;
+    tasks = task;
+  }
+
+  lwp_preempt_enable();
+}
+
+
+// === HELPER FUNCTIONS ======================================================
+// Marks a thread as having no period and being in no pool, unless we've set
+// it up already (it may have come from another scheduler, which used
+// sched_data for something else).
+// @param t The thread.
+// @return void.
+static void edf_claim(thread t) {
+  if (t->sched_data[EDF_TAG] != tag) {
+    t->sched_data[EDF_TAG] = tag;
+    t->sched_data[EDF_TASK] = (long long)(intptr_t)edf_find(t->tid);
+    t->sched_data[EDF_WHERE] = EDF_OUT;
+  }
+}
+
+// Finds the task kept for a thread id.
+// @param tid The thread id.
+// @return The task, or NULL if it was never given a period.
+static edf_task *edf_find(tid_t tid) {
+  edf_task *task = tasks;
+  while (task != NULL && task->stats.tid != tid) {
+    task = task->next_task;
+  }
+  return task;
+}
+
+// Counts a finished job, and if it finished after its deadline, a miss and
+// how late it was.
+// @param task The task.
+// @param now When the job finished.
+// @return void.
+static void edf_account(edf_task *task, long long now) {
+  edf_stats *s = &task->stats;
+  long long late = now - task->due;
+
+  s->jobs++;
+  if (late <= 0) {
+    return;
+  }
+
+  s->misses++;
+  if (late > s->max_late) {
+    s->max_late = late;
+  }
+
+  // The bucket is the bit length of the lateness in microseconds.
+  unsigned long long us = late / 1000;
+  int bucket = (us == 0) ? 0 : 64 - __builtin_clzll(us);
+  if (bucket >= EDF_HIST_BUCKETS) {
+    bucket = EDF_HIST_BUCKETS - 1;
+  }
+  s->late_hist[bucket]++;
+}
+
+
+// === FIFO FUNCTIONS ========================================================
+// Appends a thread to the FIFO.
+// @param t The thread.
+// @return void.
+static void fifo_push(thread t) {
+  t->NEXT = NULL;
+  t->PREV = tail;
+
+  if (tail != NULL) {
+    tail->NEXT = t;
+  }
+  else {
+    head = t;
+  }
+  tail = t;
+}
+
+// Takes a thread out of the FIFO.
+// @param t The thread.
+// @return void.
+static void fifo_unlink(thread t) {
+  if (t->PREV != NULL) {
+    t->PREV->NEXT = t->NEXT;
+  }
+  else {
+    head = t->NEXT;
+  }
+
+  if (t->NEXT != NULL) {
+    t->NEXT->PREV = t->PREV;
+  }
+  else {
+    tail = t->PREV;
+  }
+
+  // For my own sanity
+  t->NEXT = NULL;
+  t->PREV = NULL;
+}
+
+
+// === PAIRING HEAP FUNCTIONS ================================================
+// Says whether one thread comes out of the heap ahead of another.
+// @param a A periodic thread.
+// @param b Another.
+// @return TRUE if a's job is due sooner.
+static int edf_before(thread a, thread b) {
+  return TASK(a)->key < TASK(b)->key;
+}
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lwpchan.h"
+
+// === DATA DEFINITIONS ======================================================
+// A queue of parked cases, oldest first.
+typedef struct chan_queue {
+  lwp_chan_op *head;
+  lwp_chan_op *tail;
+} chan_queue;
+
+struct lwp_chan {
+  size_t     elem_size;
+  size_t     capacity;
+  size_t     head;              // the oldest buffered element
+  size_t     count;             // how many are buffered
+  int        closed;
+  char      *buf;               // capacity elements
+  chan_queue senders;           // parked, waiting for room
+  chan_queue receivers;         // parked, waiting for an element
+};
+
+// A thread parked in a select (a plain send or receive is a select of one).
+// It lives on the thread's stack.
+typedef struct chan_select {
+  thread       self;
+  int          fired;           // the case that went ahead, or -1
+  lwp_chan_op *ops;
+  int          n;
+} chan_select;
+
+
+// === HELPER FUNCTIONS ======================================================
+// Does a case now, if it can go ahead without waiting.
+static int chan_try(lwp_chan_op *op);
+// Waits until one of the cases has gone ahead.
+static int chan_wait(lwp_chan_op *ops, int n);
+// Finishes a parked case: takes its select's other cases off their queues
+// and wakes it.
+static void chan_fire(lwp_chan_op *op, int ok);
+// The queue a case parks on.
+static chan_queue *chan_queue_of(lwp_chan_op *op);
+// Adds a case to the back of a queue.
+static void q_push(chan_queue *q, lwp_chan_op *op);
+// Takes a case out of a queue.
+static void q_remove(chan_queue *q, lwp_chan_op *op);
+
+
+// === GLOBAL VARIABLES ======================================================
+// Where the next select starts looking, so no case is always first.
+static unsigned int rotation = 0;
+
+
+// === CHANNEL FUNCTIONS =====================================================
+// Makes a channel.
+// @param elem_size The size of an element.
+// @param capacity How many elements it buffers (0: none).
+// @return The channel, or NULL.
+lwp_chan *lwp_chan_create(size_t elem_size, size_t capacity) {
+  lwp_chan *chan = calloc(1, sizeof(lwp_chan));
+  if (chan == NULL) {
+    perror("[lwp_chan_create] Error when calloc()ing a channel.");
+    return NULL;
+  }
+
+  if (capacity > 0) {
+    chan->buf = malloc(elem_size * capacity);
+    if (chan->buf == NULL) {
+      perror("[lwp_chan_create] Error when malloc()ing the buffer.");
+      free(chan);
+      return NULL;
+    }
+  }
+
+  chan->elem_size = elem_size;
+  chan->capacity = capacity;
+  return chan;
+}
+
+// Frees a channel and its buffer.
+// @param chan The channel.
+// @return void.
+void lwp_chan_destroy(lwp_chan *chan) {
+  free(chan->buf);
+  free(chan);
+}
+
+// Closes a channel, and fails everybody waiting on it.
+// @param chan The channel.
+// @return void.
+void lwp_chan_close(lwp_chan *chan) {
+  lwp_preempt_disable();
+  chan->closed = TRUE;
+
+  // Receivers only wait on an empty buffer, so none of them are owed
+  // anything.
+  while (chan->receivers.head != NULL) {
+    chan_fire(chan->receivers.head, FALSE);
+  }
+  while (chan->senders.head != NULL) {
+    chan_fire(chan->senders.head, FALSE);
+  }
+  lwp_preempt_enable();
+}
+
+// Sends an element, waiting for room.
+// @param chan The channel.
+// @param elem The element.
+// @return TRUE, or FALSE if the channel is closed.
+int lwp_chan_send(lwp_chan *chan, const void *elem) {
+  lwp_chan_op op = { chan, LWP_CHAN_SEND, (void *)elem };
+  chan_wait(&op, 1);
+  return op.ok;
+}
+
+// Receives an element, waiting for one.
+// @param chan The channel.
+// @param elem Where to put it.
+// @return TRUE, or FALSE if the channel is closed and empty.
+int lwp_chan_recv(lwp_chan *chan, void *elem) {
+  lwp_chan_op op = { chan, LWP_CHAN_RECV, elem };
+  chan_wait(&op, 1);
+  return op.ok;
+}
+
+// Sends an element if that doesn't mean waiting.
+// @param chan The channel.
+// @param elem The element.
+// @return TRUE if it was sent.
+int lwp_chan_try_send(lwp_chan *chan, const void *elem) {
+  lwp_chan_op op = { chan, LWP_CHAN_SEND, (void *)elem };
+
+  lwp_preempt_disable();
+  int done = chan_try(&op);
+  lwp_preempt_enable();
+
+  return done && op.ok;
+}
+
+// Receives an element if there is one.
+// @param chan The channel.
+// @param elem Where to put it.
+// @return TRUE if one was received.
+int lwp_chan_try_recv(lwp_chan *chan, void *elem) {
+  lwp_chan_op op = { chan, LWP_CHAN_RECV, elem };
+
+  lwp_preempt_disable();
+  int done = chan_try(&op);
+  lwp_preempt_enable();
+
+  return done && op.ok;
+}
+
+// Does whichever case can go ahead first.
+// @param ops The cases.
+// @param n How many there are.
+// @return The index of the one that did.
+int lwp_chan_select(lwp_chan_op *ops, int n) {
+  return chan_wait(ops, n);
+}
+
+
+// === HELPER FUNCTIONS ======================================================
+// Does a case if it can go ahead right now. A send hands its element to the
+// oldest parked receiver, or buffers it; a receive takes the oldest buffered
+// element (and lets the oldest parked sender put its own in behind), or takes
+// a parked sender's element directly. Either goes ahead, and fails, on a
+// closed channel. Preemption must be masked.
+// @param op The case.
+// @return TRUE if it went ahead (op->ok says how), FALSE if it has to wait.
+static int chan_try(lwp_chan_op *op) {
+  lwp_chan *chan = op->chan;
+  size_t size = chan->elem_size;
+  lwp_chan_op *other;
+
+  op->ok = TRUE;
+  if (op->dir == LWP_CHAN_SEND) {
+    if (chan->closed) {
+      op->ok = FALSE;
+      return TRUE;
+    }
+
+    // A parked receiver means the buffer is empty.
+    other = chan->receivers.head;
+    if (other != NULL) {
+      memcpy(other->elem, op->elem, size);
+      chan_fire(other, TRUE);
+      return TRUE;
+    }
+
+    if (chan->count < chan->capacity) {
+      size_t tail = (chan->head + chan->count) % chan->capacity;
+      memcpy(chan->buf + tail * size, op->elem, size);
+      chan->count++;
+      return TRUE;
+    }
+    return FALSE;
+  }
+
+  other = chan->senders.head;
+  if (chan->count > 0) {
+    memcpy(op->elem, chan->buf + chan->head * size, size);
+    chan->head = (chan->head + 1) % chan->capacity;
+    chan->count--;
+
+    // There is room now, for the sender that has waited longest.
+    if (other != NULL) {
+      size_t tail = (chan->head + chan->count) % chan->capacity;
+      memcpy(chan->buf + tail * size, other->elem, size);
+      chan->count++;
+      chan_fire(other, TRUE);
+    }
+    return TRUE;
+  }
+
+  // Unbuffered (or nobody got here before the sender parked).
+  if (other != NULL) {
+    memcpy(op->elem, other->elem, size);
+    chan_fire(other, TRUE);
+    return TRUE;
+  }
+
+  if (chan->closed) {
+    op->ok = FALSE;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+// Does the first case that can go ahead, starting from a different one each
+// time. If none can, parks on every case's channel until somebody else
+// finishes one of them for us.
+// @param ops The cases.
+// @param n How many.
+// @return The index of the case that went ahead.
+static int chan_wait(lwp_chan_op *ops, int n) {
+  int i;
+
+  lwp_preempt_disable();
+
+  int start = (n > 1) ? (int)(rotation++ % (unsigned int)n) : 0;
+  for (i = 0; i < n; i++) {
+    int k = (start + i) % n;
+    if (chan_try(&ops[k])) {
+      lwp_preempt_enable();
+      return k;
+    }
+  }
+
+  chan_select sel;
+  sel.self = lwp_self();
+  sel.fired = -1;
+  sel.ops = ops;
+  sel.n = n;
+
+  for (i = 0; i < n; i++) {
+    ops[i].select = &sel;
+    q_push(chan_queue_of(&ops[i]), &ops[i]);
+  }
+
+  // chan_fire() unparks us once one case is done.
+  lwp_park();
+
+  lwp_preempt_enable();
+  return sel.fired;
+}
+
+// Marks a parked case done, takes every case of its select off its queue,
+// and unparks the thread.
+// @param op The case.
+// @param ok Whether it worked.
+// @return void.
+static void chan_fire(lwp_chan_op *op, int ok) {
+  chan_select *sel = op->select;
+  int i;
+
+  op->ok = ok;
+  sel->fired = (int)(op - sel->ops);
+
+  for (i = 0; i < sel->n; i++) {
+    if (sel->ops[i].queued) {
+      q_remove(chan_queue_of(&sel->ops[i]), &sel->ops[i]);
+    }
+  }
+
+  lwp_unpark(sel->self);
+}
+
+// Finds the queue a case waits on.
+// @param op The case.
+// @return Its channel's senders or receivers.
+static chan_queue *chan_queue_of(lwp_chan_op *op) {
+  return (op->dir == LWP_CHAN_SEND) ? &op->chan->senders :
+    &op->chan->receivers;
+}
+
+// Adds a case to the back of a queue.
+// @param q The queue.
+// @param op The case.
+// @return void.
+static void q_push(chan_queue *q, lwp_chan_op *op) {
+  op->next = NULL;
+  op->prev = q->tail;
+  if (q->tail == NULL) {
+    q->head = op;
+  }
+  else {
+    q->tail->next = op;
+  }
+  q->tail = op;
+  op->queued = TRUE;
+}
+
+// Takes a case out of a queue, wherever it is.
+// @param q The queue.
+// @param op The case.
+// @return void.
+static void q_remove(chan_queue *q, lwp_chan_op *op) {
+  if (op->prev == NULL) {
+    q->head = op->next;
+  }
+  else {
+    op->prev->next = op->next;
+  }
+
+  if (op->next == NULL) {
+    q->tail = op->prev;
+  }
+  else {
+    op->next->prev = op->prev;
+  }
+
+  op->next = NULL;
+  op->prev = NULL;
+  op->queued = FALSE;
+}
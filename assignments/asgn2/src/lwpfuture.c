@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "lwpfuture.h"
+
+// === HELPER FUNCTIONS ======================================================
+// Sets a future's result, wakes its waiters and runs its continuations.
+static int future_settle(lwp_future *future, void *value, int error);
+
+
+// === DATA DEFINITIONS ======================================================
+// A continuation waiting for its future.
+typedef struct future_cont {
+  lwp_future_fn       fn;
+  void               *arg;
+  struct future_cont *next;
+} future_cont;
+
+struct lwp_future {
+  int          done;
+  void        *value;
+  int          error;           // 0 if it completed with a value
+  thread       head;            // parked in lwp_future_get(), oldest first
+  thread       tail;            // (linked through wait_next)
+  future_cont *conts;           // oldest first
+  future_cont *conts_tail;
+};
+
+
+// === FUTURE FUNCTIONS ======================================================
+// Makes a future.
+// @param void.
+// @return The future, or NULL.
+lwp_future *lwp_future_create(void) {
+  lwp_preempt_disable();
+  lwp_future *future = calloc(1, sizeof(lwp_future));
+  lwp_preempt_enable();
+
+  if (future == NULL) {
+    perror("[lwp_future_create] Error when calloc()ing a future.");
+  }
+  return future;
+}
+
+// Frees a future and any continuations still hanging on it.
+// @param future The future.
+// @return void.
+void lwp_future_destroy(lwp_future *future) {
+  lwp_preempt_disable();
+  while (future->conts != NULL) {
+    future_cont *c = future->conts;
+    future->conts = c->next;
+    free(c);
+  }
+  free(future);
+  lwp_preempt_enable();
+}
+
+// Completes a future with a value.
+// @param future The future.
+// @param value The value.
+// @return 0, or -1 if it had already completed.
+int lwp_future_complete(lwp_future *future, void *value) {
+  return future_settle(future, value, 0);
+}
+
+// Fails a future.
+// @param future The future.
+// @param error What went wrong (not 0).
+// @return 0, or -1 if it had already completed.
+int lwp_future_fail(lwp_future *future, int error) {
+  return future_settle(future, NULL, error);
+}
+
+// Waits for a future to complete.
+// @param future The future.
+// @param value Where to put its value (or NULL).
+// @return 0, or the error it failed with.
+int lwp_future_get(lwp_future *future, void **value) {
+  lwp_preempt_disable();
+  if (!future->done) {
+    thread self = lwp_self();
+    self->wait_next = NULL;
+    if (future->tail == NULL) {
+      future->head = self;
+    }
+    else {
+      future->tail->wait_next = self;
+    }
+    future->tail = self;
+
+    // future_settle() unparks us.
+    lwp_park();
+  }
+  lwp_preempt_enable();
+
+  if (future->error == 0 && value != NULL) {
+    *value = future->value;
+  }
+  return future->error;
+}
+
+// Says whether a future has completed.
+// @param future The future.
+// @return TRUE if it has.
+int lwp_future_ready(lwp_future *future) {
+  return future->done;
+}
+
+// Hangs a continuation on a future, or runs it if the future is done.
+// @param future The future.
+// @param fn The continuation.
+// @param arg Its argument.
+// @return 0, or -1 if there is no memory.
+int lwp_future_then(lwp_future *future, lwp_future_fn fn, void *arg) {
+  lwp_preempt_disable();
+  if (future->done) {
+    lwp_preempt_enable();
+    fn(future, arg);
+    return 0;
+  }
+
+  future_cont *c = malloc(sizeof(future_cont));
+  if (c == NULL) {
+    lwp_preempt_enable();
+    perror("[lwp_future_then] Error when malloc()ing a continuation.");
+    return -1;
+  }
+
+  c->fn = fn;
+  c->arg = arg;
+  c->next = NULL;
+  if (future->conts_tail == NULL) {
+    future->conts = c;
+  }
+  else {
+    future->conts_tail->next = c;
+  }
+  future->conts_tail = c;
+  lwp_preempt_enable();
+
+  return 0;
+}
+
+
+// === HELPER FUNCTIONS ======================================================
+// Completes a future: records the result, makes every waiter runnable again
+// (oldest first), then runs the continuations in the order they were hung.
+// They run with preemption on, since they are the user's code; the list is
+// taken off the future first, so one that hangs another on it runs that one
+// at once instead.
+// @param future The future.
+// @param value The value (if error is 0).
+// @param error The error, or 0.
+// @return 0, or -1 if it had already completed.
+static int future_settle(lwp_future *future, void *value, int error) {
+  lwp_preempt_disable();
+  if (future->done) {
+    lwp_preempt_enable();
+    return -1;
+  }
+
+  future->value = value;
+  future->error = error;
+  future->done = TRUE;
+
+  while (future->head != NULL) {
+    thread t = future->head;
+    future->head = t->wait_next;
+    t->wait_next = NULL;
+    lwp_unpark(t);
+  }
+  future->tail = NULL;
+
+  future_cont *c = future->conts;
+  future->conts = NULL;
+  future->conts_tail = NULL;
+  lwp_preempt_enable();
+
+  while (c != NULL) {
+    future_cont *next = c->next;
+    c->fn(future, c->arg);
+
+    lwp_preempt_disable();
+    free(c);
+    lwp_preempt_enable();
+    c = next;
+  }
+
+  return 0;
+}
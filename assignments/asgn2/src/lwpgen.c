@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "lwpgen.h"
+
+// === MACROS ================================================================
+// All stack frames must be built on this boundary.
+#define BYTE_STACK_ALIGNMENT 16
+
+
+// === DATA DEFINITIONS ======================================================
+// A generator. It lives at the top of its own mapping, with its stack right
+// under it and a guard page at the bottom.
+struct lwp_gen {
+  rfile       state;            // the generator, while it is switched out
+  rfile       caller;           // whoever resumed it, while it runs
+  lwp_genfun  fun;
+  void       *arg;
+  void       *value;            // the last thing it yielded
+  int         done;             // fun has returned
+  lwp_gen    *outer;            // the generator that resumed it (or NULL)
+  void       *map;              // the whole mapping
+  size_t      mapsize;
+};
+
+
+// === HELPER FUNCTIONS ======================================================
+// Where the innermost running generator is kept for the caller.
+static lwp_gen **gen_current(void);
+// Builds the frame a generator starts from.
+static void gen_frame(lwp_gen *gen);
+// Runs a generator's function and switches out for the last time.
+static void gen_wrap(lwp_gen *gen);
+
+
+// === GLOBAL VARIABLES ======================================================
+// The innermost running generator of a pthread that isn't running an LWP.
+// An LWP keeps its own in its context, since it may switch away (and move to
+// another worker) from inside one.
+static __thread lwp_gen *outside = NULL;
+
+
+// === GENERATOR FUNCTIONS ===================================================
+// Maps a generator's stack, puts the generator at its top, and gets it ready
+// to run fun(arg).
+// @param fun The function.
+// @param arg Its argument.
+// @param stack The size of the stack (0 for LWP_GEN_STACK_DEFAULT).
+// @return The generator, or NULL.
+lwp_gen *lwp_gen_create(lwp_genfun fun, void *arg, size_t stack) {
+  size_t page = sysconf(_SC_PAGE_SIZE);
+  if (stack == 0) {
+    stack = LWP_GEN_STACK_DEFAULT;
+  }
+
+  // The stack, the generator above it, and the guard page below.
+  size_t mapsize = (stack + sizeof(lwp_gen) + page - 1) / page * page + page;
+  void *map = mmap(NULL, mapsize, PROT_READ|PROT_WRITE,
+      MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+  if (map == MAP_FAILED) {
+    perror("[lwp_gen_create] Error when mmap()ing a stack.");
+    return NULL;
+  }
+  if (mprotect(map, page, PROT_NONE) == -1) {
+    perror("[lwp_gen_create] Error when protecting the guard page.");
+  }
+
+  uintptr_t top = (uintptr_t)map + mapsize - sizeof(lwp_gen);
+  lwp_gen *gen = (lwp_gen *)(top & ~(uintptr_t)(BYTE_STACK_ALIGNMENT - 1));
+  gen->map = map;
+  gen->mapsize = mapsize;
+
+  lwp_gen_reset(gen, fun, arg);
+  return gen;
+}
+
+// Switches into a generator, and comes back when it yields or returns.
+// @param gen The generator.
+// @param value Where to put what it yielded (or NULL).
+// @return TRUE if it yielded, FALSE if it has returned.
+int lwp_gen_next(lwp_gen *gen, void **value) {
+  if (gen->done) {
+    return FALSE;
+  }
+
+  lwp_gen **current = gen_current();
+  gen->outer = *current;
+  *current = gen;
+
+  swap_rfiles_fast(&gen->caller, &gen->state);
+
+  // The generator may have switched LWPs out from under us, but whichever
+  // LWP we are, it is the one that resumed gen.
+  *gen_current() = gen->outer;
+
+  if (gen->done) {
+    return FALSE;
+  }
+  if (value != NULL) {
+    *value = gen->value;
+  }
+  return TRUE;
+}
+
+// Hands a value back out of the running generator.
+// @param value The value.
+// @return void.
+void lwp_gen_yield(void *value) {
+  lwp_gen *gen = *gen_current();
+  if (gen == NULL) {
+    fprintf(stderr, "[lwp_gen_yield] Not in a generator. Bailing now...\n");
+    exit(EXIT_FAILURE);
+  }
+
+  gen->value = value;
+  swap_rfiles_fast(&gen->state, &gen->caller);
+}
+
+// Says whether a generator's function has returned.
+// @param gen The generator.
+// @return TRUE if it has.
+int lwp_gen_done(lwp_gen *gen) {
+  return gen->done;
+}
+
+// Points a generator at a new function, to start from the top of its stack.
+// @param gen The generator.
+// @param fun The function.
+// @param arg Its argument.
+// @return void.
+void lwp_gen_reset(lwp_gen *gen, lwp_genfun fun, void *arg) {
+  gen->fun = fun;
+  gen->arg = arg;
+  gen->value = NULL;
+  gen->done = FALSE;
+  gen->outer = NULL;
+  gen_frame(gen);
+}
+
+// Unmaps a generator.
+// @param gen The generator.
+// @return void.
+void lwp_gen_destroy(lwp_gen *gen) {
+  if (munmap(gen->map, gen->mapsize) == -1) {
+    perror("[lwp_gen_destroy] Error when munmap()ing a stack.");
+  }
+}
+
+
+// === HELPER FUNCTIONS ======================================================
+// Finds where the calling LWP (or pthread) keeps its innermost generator.
+// @param void.
+// @return A pointer to it.
+static lwp_gen **gen_current(void) {
+  thread self = lwp_self();
+  return (self != NULL) ? &self->gen : &outside;
+}
+
+// Builds a frame at the top of the stack that returns into lwp_trampoline(),
+// which calls gen_wrap(gen), the same way lwp_create() starts a thread.
+// @param gen The generator.
+// @return void.
+static void gen_frame(lwp_gen *gen) {
+  // The control words (and the rest) start out as the creator's.
+  swap_rfiles_fast(&gen->state, NULL);
+
+  uintptr_t *stack = (uintptr_t *)gen;
+  stack = stack - (uintptr_t)(BYTE_STACK_ALIGNMENT);
+  *stack = (uintptr_t)lwp_trampoline;
+  stack--;
+
+  gen->state.rbp = (unsigned long)stack;
+  gen->state.rsp = (unsigned long)stack;
+  gen->state.r12 = (unsigned long)gen;
+  gen->state.r13 = 0;
+  gen->state.r14 = (unsigned long)gen_wrap;
+}
+
+// Runs the generator's function, then switches back to whoever resumed it
+// for the last time. Never returns.
+// @param gen The generator.
+// @return void.
+static void gen_wrap(lwp_gen *gen) {
+  gen->fun(gen->arg);
+  gen->done = TRUE;
+  swap_rfiles_fast(NULL, &gen->caller);
+}
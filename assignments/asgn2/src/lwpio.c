@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "lwpio.h"
+
+// === MACROS ================================================================
+// The most events collected by one epoll_wait().
+#define IO_MAX_EVENTS 64
+
+// The smallest fd table we bother allocating.
+#define IO_MIN_FDS 64
+
+
+// === DATA DEFINITIONS ======================================================
+// What we know about an fd, and who is parked on it.
+typedef struct fdwait {
+  int    known;                  // made non-blocking and added to epoll
+  thread rd_head;                // waiting to read (or accept)
+  thread rd_tail;
+  thread wr_head;                // waiting to write (or connect)
+  thread wr_tail;
+} fdwait;
+
+
+// === HELPER FUNCTIONS ======================================================
+// Gets an fd ready for use: non-blocking and on the epoll interest list.
+static int io_prepare(int fd);
+// Parks the calling thread until fd is readable (or writable).
+static void io_wait(int fd, int writing);
+// Lets ticks in again once a call is done with fd, keeping errno.
+static ssize_t io_leave(ssize_t ret);
+// Unparks every thread on a wait queue.
+static void io_wake(thread *head, thread *tail);
+// The scheduler's idle hook: waits for ready fds and unparks their waiters.
+static int io_idle(long long timeout_ns);
+
+
+// === GLOBAL VARIABLES ======================================================
+// The epoll instance every fd is registered with (-1 until first use).
+static int epfd = -1;
+
+// Indexed by fd.
+static fdwait *fds = NULL;
+static int nfds = 0;
+
+// How many threads are parked on fds right now.
+static int waiting = 0;
+
+
+// === I/O FUNCTIONS =========================================================
+// Reads up to count bytes from fd, parking until there is something to read.
+// @param fd The file descriptor.
+// @param buf Where to put the bytes.
+// @param count The most bytes to read.
+// @return The number of bytes read, 0 at EOF, or -1 on error.
+ssize_t lwp_read(int fd, void *buf, size_t count) {
+  if (io_prepare(fd) == -1) {
+    return -1;
+  }
+
+  // No ticks from the syscall until we are queued (see io_wait()).
+  lwp_preempt_disable();
+  while (TRUE) {
+    ssize_t n = read(fd, buf, count);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+      return io_leave(n);
+    }
+    if (errno != EINTR) {
+      io_wait(fd, FALSE);
+    }
+  }
+}
+
+// Writes up to count bytes to fd, parking until there is room for some.
+// @param fd The file descriptor.
+// @param buf The bytes to write.
+// @param count How many bytes to write.
+// @return The number of bytes written, or -1 on error.
+ssize_t lwp_write(int fd, const void *buf, size_t count) {
+  if (io_prepare(fd) == -1) {
+    return -1;
+  }
+
+  // No ticks from the syscall until we are queued (see io_wait()).
+  lwp_preempt_disable();
+  while (TRUE) {
+    ssize_t n = write(fd, buf, count);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+      return io_leave(n);
+    }
+    if (errno != EINTR) {
+      io_wait(fd, TRUE);
+    }
+  }
+}
+
+// Accepts a connection on a listening socket, parking until one arrives. The
+// new socket is already non-blocking.
+// @param fd The listening socket.
+// @param addr Filled in with the peer's address (may be NULL).
+// @param addrlen The size of addr (may be NULL).
+// @return The new socket, or -1 on error.
+int lwp_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+  if (io_prepare(fd) == -1) {
+    return -1;
+  }
+
+  // No ticks from the syscall until we are queued (see io_wait()).
+  lwp_preempt_disable();
+  while (TRUE) {
+    int conn = accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn >= 0) {
+      if (io_prepare(conn) == -1) {
+        // Don't leak it; the caller never sees the descriptor.
+        int err = errno;
+        close(conn);
+        errno = err;
+        return io_leave(-1);
+      }
+      return io_leave(conn);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      return io_leave(-1);
+    }
+    if (errno != EINTR) {
+      io_wait(fd, FALSE);
+    }
+  }
+}
+
+// Connects a socket, parking until the connection is made (or fails).
+// @param fd The socket.
+// @param addr The address to connect to.
+// @param addrlen The size of addr.
+// @return 0, or -1 on error.
+int lwp_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+  if (io_prepare(fd) == -1) {
+    return -1;
+  }
+
+  // No ticks from the syscall until we are queued (see io_wait()).
+  lwp_preempt_disable();
+  if (connect(fd, addr, addrlen) == 0) {
+    return io_leave(0);
+  }
+  if (errno != EINPROGRESS && errno != EINTR) {
+    return io_leave(-1);
+  }
+
+  // It is done when the socket turns writable. Whether it worked is in
+  // SO_ERROR.
+  io_wait(fd, TRUE);
+
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+    return io_leave(-1);
+  }
+  if (err != 0) {
+    errno = err;
+    return io_leave(-1);
+  }
+
+  return io_leave(0);
+}
+
+// Closes an fd and clears its entry, so a later fd with the same number
+// starts from scratch. Nobody should be parked on it.
+// @param fd The file descriptor.
+// @return What close() returns.
+int lwp_close(int fd) {
+  if (fd >= 0 && fd < nfds) {
+    memset(&fds[fd], 0, sizeof(fdwait));
+  }
+
+  // close() takes it off the epoll list too.
+  return close(fd);
+}
+
+
+// === HELPER FUNCTIONS ======================================================
+// Gets an fd ready for use the first time we see it: the epoll instance and
+// idle hook are set up if need be, the fd table grown to fit, the fd made
+// non-blocking and added to the interest list (edge triggered, for both
+// directions, so it never has to be modified again).
+// @param fd The file descriptor.
+// @return 0, or -1 on error.
+static int io_prepare(int fd) {
+  if (fd < 0) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (fd < nfds && fds[fd].known) {
+    return 0;
+  }
+
+  if (epfd == -1) {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+      perror("[io_prepare] Error when creating the epoll instance.");
+      return -1;
+    }
+    lwp_set_idle(io_idle);
+  }
+
+  if (fd >= nfds) {
+    int size = (nfds == 0) ? IO_MIN_FDS : nfds;
+    while (size <= fd) {
+      size *= 2;
+    }
+
+    lwp_preempt_disable();
+    fdwait *bigger = realloc(fds, size * sizeof(fdwait));
+    lwp_preempt_enable();
+    if (bigger == NULL) {
+      perror("[io_prepare] Error when growing the fd table.");
+      return -1;
+    }
+
+    memset(bigger + nfds, 0, (size - nfds) * sizeof(fdwait));
+    fds = bigger;
+    nfds = size;
+  }
+
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    return -1;
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.fd = fd;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1 && errno != EEXIST) {
+    // Regular files can't be polled, but they never block either.
+    if (errno != EPERM) {
+      return -1;
+    }
+  }
+
+  fds[fd].known = TRUE;
+  return 0;
+}
+
+// Queues the calling thread on fd and parks it. Whoever sees fd turn ready
+// unparks it, and the caller retries its syscall. The caller disabled
+// preemption before that syscall: fds are edge triggered, so a tick between
+// its EAGAIN and our queueing could poll away the only edge, and nothing
+// would ever unpark us.
+// @param fd The file descriptor.
+// @param writing TRUE to wait until fd is writable, FALSE for readable.
+// @return void.
+static void io_wait(int fd, int writing) {
+  thread self = lwp_self();
+  thread *head = writing ? &fds[fd].wr_head : &fds[fd].rd_head;
+  thread *tail = writing ? &fds[fd].wr_tail : &fds[fd].rd_tail;
+
+  self->wait_next = NULL;
+  if (*head == NULL) {
+    *head = self;
+  }
+  else {
+    (*tail)->wait_next = self;
+  }
+  *tail = self;
+  waiting++;
+
+  lwp_park();
+}
+
+// Enables preemption again after an I/O call. A deferred tick may switch
+// threads right here, and errno belongs to the pthread, not the LWP, so it
+// is put back afterwards.
+// @param ret What the call is about to return.
+// @return ret.
+static ssize_t io_leave(ssize_t ret) {
+  int err = errno;
+  lwp_preempt_enable();
+  errno = err;
+  return ret;
+}
+
+// Unparks every thread on a wait queue and empties it.
+// @param head A pointer to the head of the queue.
+// @param tail A pointer to the tail of the queue.
+// @return void.
+static void io_wake(thread *head, thread *tail) {
+  thread t = *head;
+  *head = NULL;
+  *tail = NULL;
+
+  while (t != NULL) {
+    thread next = t->wait_next;
+    waiting--;
+    lwp_unpark(t);
+    t = next;
+  }
+}
+
+// Waits (up to timeout_ns, or forever if it is negative) for some fd with a
+// thread parked on it to become ready, and unparks the threads waiting on it.
+// @param timeout_ns How long to wait.
+// @return FALSE if nobody is parked on an fd, TRUE otherwise.
+static int io_idle(long long timeout_ns) {
+  if (waiting == 0) {
+    return FALSE;
+  }
+
+  // Rounded up to whole milliseconds, and clamped so the cast can't wrap.
+  int timeout_ms = -1;
+  if (timeout_ns >= 0) {
+    long long ms = timeout_ns / 1000000 + (timeout_ns % 1000000 != 0);
+    timeout_ms = (ms > INT_MAX) ? INT_MAX : (int)ms;
+  }
+
+  struct epoll_event ev[IO_MAX_EVENTS];
+  int n = epoll_wait(epfd, ev, IO_MAX_EVENTS, timeout_ms);
+
+  int i;
+  for (i = 0; i < n; i++) {
+    int fd = ev[i].data.fd;
+    if (fd >= nfds) {
+      continue;
+    }
+
+    // Errors and hangups wake both sides; their syscalls will report it.
+    uint32_t e = ev[i].events;
+    if (e & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+      io_wake(&fds[fd].rd_head, &fds[fd].rd_tail);
+    }
+    if (e & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+      io_wake(&fds[fd].wr_head, &fds[fd].wr_tail);
+    }
+  }
+
+  return TRUE;
+}
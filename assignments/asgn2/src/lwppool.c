@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "lwppool.h"
+#include "lwpsync.h"
+
+// === HELPER FUNCTIONS ======================================================
+// The loop each worker LWP runs.
+static int pool_worker(void *arg);
+// Takes the task at the front of the queue (or NULL).
+static lwp_task *pool_pop(void);
+// Gets a task off the spare list, or mallocs one.
+static lwp_task *task_alloc(void);
+
+
+// === DATA DEFINITIONS ======================================================
+struct lwp_task {
+  lwpfun    fun;
+  void     *arg;
+  int       result;
+  int       done;
+  thread    waiter;             // parked in lwp_pool_wait(), or NULL
+  lwp_task *next;               // in the queue, or on the spare list
+};
+
+
+// === GLOBAL VARIABLES ======================================================
+// The queue of tasks no worker has taken yet. work counts them (plus one for
+// each worker that has been told to stop), so idle workers park on it.
+static lwp_task *queue_head = NULL;
+static lwp_task *queue_tail = NULL;
+static lwp_sem work;
+
+// Workers that haven't exited, and whether they have been told to.
+static int workers = 0;
+static int stopping = FALSE;
+
+// Finished tasks, kept for reuse so that a steady stream of them never
+// reaches malloc().
+static lwp_task *spare = NULL;
+
+
+// === POOL FUNCTIONS ========================================================
+// Starts the pool's worker LWPs.
+// @param n How many workers.
+// @return 0, or -1 if there already is a pool or a worker can't be created.
+int lwp_pool_create(int n) {
+  if (workers > 0 || n < 1) {
+    return -1;
+  }
+
+  lwp_sem_init(&work, 0);
+  stopping = FALSE;
+
+  int i;
+  for (i = 0; i < n; i++) {
+    tid_t tid = lwp_create(pool_worker, NULL);
+    if (tid == NO_THREAD) {
+      fprintf(stderr, "[lwp_pool_create] Could only create %d workers.\n", i);
+      break;
+    }
+    lwp_detach(tid);
+    workers++;
+  }
+
+  return (workers > 0) ? 0 : -1;
+}
+
+// Queues a function for the next free worker.
+// @param fun The function.
+// @param arg Its argument.
+// @return The task's handle, or NULL if there is no pool or no memory.
+lwp_task *lwp_pool_submit(lwpfun fun, void *arg) {
+  if (workers == 0 || stopping) {
+    return NULL;
+  }
+
+  lwp_preempt_disable();
+  lwp_task *task = task_alloc();
+  if (task == NULL) {
+    lwp_preempt_enable();
+    return NULL;
+  }
+
+  task->fun = fun;
+  task->arg = arg;
+  task->result = 0;
+  task->done = FALSE;
+  task->waiter = NULL;
+  task->next = NULL;
+
+  if (queue_tail == NULL) {
+    queue_head = task;
+  }
+  else {
+    queue_tail->next = task;
+  }
+  queue_tail = task;
+  lwp_preempt_enable();
+
+  // Wakes an idle worker, if there is one.
+  lwp_sem_post(&work);
+  return task;
+}
+
+// Waits for a task to finish, and frees it.
+// @param task The handle lwp_pool_submit() returned.
+// @return What the task's function returned.
+int lwp_pool_wait(lwp_task *task) {
+  lwp_preempt_disable();
+  if (!task->done) {
+    // The worker that finishes it unparks us.
+    task->waiter = lwp_self();
+    lwp_park();
+  }
+
+  int result = task->result;
+  task->next = spare;
+  spare = task;
+  lwp_preempt_enable();
+
+  return result;
+}
+
+// Tells every worker to exit once the queue is empty, and yields until they
+// all have.
+// @param void.
+// @return void.
+void lwp_pool_destroy(void) {
+  if (workers == 0) {
+    return;
+  }
+
+  stopping = TRUE;
+  int i, n = workers;
+  for (i = 0; i < n; i++) {
+    lwp_sem_post(&work);
+  }
+
+  while (workers > 0) {
+    lwp_yield();
+  }
+}
+
+
+// === HELPER FUNCTIONS ======================================================
+// Takes tasks off the queue and runs them until told to stop. Every post to
+// work is either a task or a stop, so a worker that gets past the semaphore
+// and finds the queue empty is done.
+// @param arg Unused.
+// @return 0.
+static int pool_worker(void *arg) {
+  while (TRUE) {
+    lwp_sem_wait(&work);
+
+    lwp_preempt_disable();
+    lwp_task *task = pool_pop();
+    lwp_preempt_enable();
+
+    if (task == NULL) {
+      break;
+    }
+
+    int result = task->fun(task->arg);
+
+    lwp_preempt_disable();
+    task->result = result;
+    task->done = TRUE;
+    if (task->waiter != NULL) {
+      lwp_unpark(task->waiter);
+    }
+    lwp_preempt_enable();
+  }
+
+  workers--;
+  return 0;
+}
+
+// Takes the oldest task off the queue.
+// @param void.
+// @return The task, or NULL if the queue is empty.
+static lwp_task *pool_pop(void) {
+  lwp_task *task = queue_head;
+  if (task != NULL) {
+    queue_head = task->next;
+    if (queue_head == NULL) {
+      queue_tail = NULL;
+    }
+  }
+  return task;
+}
+
+// Reuses a finished task if there is one.
+// @param void.
+// @return A task, or NULL if malloc() fails.
+static lwp_task *task_alloc(void) {
+  lwp_task *task = spare;
+  if (task != NULL) {
+    spare = task->next;
+    return task;
+  }
+
+  task = malloc(sizeof(lwp_task));
+  if (task == NULL) {
+    perror("[lwp_pool_submit] Error when malloc()ing a task.");
+  }
+  return task;
+}
@@ -0,0 +1,417 @@
+#include <stddef.h>
+#include "lwpsync.h"
+#include "lwptimer.h"
+
+// === HELPER FUNCTIONS ======================================================
+// Adds a thread to the back of a wait queue.
+static void wq_push(lwp_waitq *q, thread t);
+// Takes the thread at the front of a wait queue (or NULL).
+static thread wq_pop(lwp_waitq *q);
+// Queues the calling thread and parks it until somebody unparks it.
+static void wq_block(lwp_waitq *q);
+// The same, but gives up after a while.
+static int wq_block_timed(lwp_waitq *q, long long ns);
+// Takes a thread out of the middle of a wait queue.
+static int wq_remove(lwp_waitq *q, thread t);
+// Pulls a waiter whose time is up off its queue and unparks it.
+static void wq_timeout_fire(lwp_timer *t);
+
+
+// === DATA DEFINITIONS ======================================================
+// The timer a timed wait arms. It lives on the waiter's stack.
+typedef struct wq_timeout {
+  lwp_timer  timer;             // must be first
+  lwp_waitq *q;
+  thread     self;
+  int        timed_out;
+} wq_timeout;
+
+
+// === MUTEX FUNCTIONS =======================================================
+// Initializes an unlocked mutex.
+// @param m The mutex.
+// @return void.
+void lwp_mutex_init(lwp_mutex *m) {
+  m->owner = NULL;
+  m->waiters.head = NULL;
+  m->waiters.tail = NULL;
+}
+
+// Locks a mutex, parking until it is handed to us if somebody holds it.
+// @param m The mutex.
+// @return void.
+void lwp_mutex_lock(lwp_mutex *m) {
+  lwp_preempt_disable();
+  if (m->owner == NULL) {
+    m->owner = lwp_self();
+  }
+  else {
+    // lwp_mutex_unlock() makes us the owner before unparking us.
+    wq_block(&m->waiters);
+  }
+  lwp_preempt_enable();
+}
+
+// Locks a mutex if nobody holds it.
+// @param m The mutex.
+// @return TRUE if we got it, FALSE if it is held.
+int lwp_mutex_trylock(lwp_mutex *m) {
+  int got = FALSE;
+
+  lwp_preempt_disable();
+  if (m->owner == NULL) {
+    m->owner = lwp_self();
+    got = TRUE;
+  }
+  lwp_preempt_enable();
+
+  return got;
+}
+
+// Locks a mutex, parking for at most ns nanoseconds if somebody holds it.
+// @param m The mutex.
+// @param ns How long to wait.
+// @return TRUE if we got it, FALSE if we timed out.
+int lwp_mutex_timedlock(lwp_mutex *m, long long ns) {
+  int got = TRUE;
+
+  lwp_preempt_disable();
+  if (m->owner == NULL) {
+    m->owner = lwp_self();
+  }
+  else {
+    got = wq_block_timed(&m->waiters, ns);
+  }
+  lwp_preempt_enable();
+
+  return got;
+}
+
+// Unlocks a mutex. If anybody is waiting, the oldest waiter becomes the owner
+// and is unparked.
+// @param m The mutex (held by the caller).
+// @return void.
+void lwp_mutex_unlock(lwp_mutex *m) {
+  lwp_preempt_disable();
+  m->owner = wq_pop(&m->waiters);
+  if (m->owner != NULL) {
+    lwp_unpark(m->owner);
+  }
+  lwp_preempt_enable();
+}
+
+
+// === CONDITION VARIABLE FUNCTIONS ==========================================
+// Initializes a condition variable with nobody waiting.
+// @param c The condition variable.
+// @return void.
+void lwp_cond_init(lwp_cond *c) {
+  c->mutex = NULL;
+  c->waiters.head = NULL;
+  c->waiters.tail = NULL;
+}
+
+// Unlocks m and parks until signalled, then returns with m held again. Every
+// thread waiting on c at once must use the same m.
+// @param c The condition variable.
+// @param m The mutex (held by the caller).
+// @return void.
+void lwp_cond_wait(lwp_cond *c, lwp_mutex *m) {
+  lwp_preempt_disable();
+  c->mutex = m;
+
+  // Both halves happen before we park, so no signal can slip in between.
+  m->owner = wq_pop(&m->waiters);
+  if (m->owner != NULL) {
+    lwp_unpark(m->owner);
+  }
+
+  // A signal either hands us m or moves us onto its queue, so we hold it
+  // when we wake.
+  wq_block(&c->waiters);
+  lwp_preempt_enable();
+}
+
+// Like lwp_cond_wait(), but gives up after ns nanoseconds. Either way, it
+// returns with m held.
+// @param c The condition variable.
+// @param m The mutex (held by the caller).
+// @param ns How long to wait.
+// @return TRUE if we were signalled, FALSE if we timed out.
+int lwp_cond_timedwait(lwp_cond *c, lwp_mutex *m, long long ns) {
+  lwp_preempt_disable();
+  c->mutex = m;
+
+  m->owner = wq_pop(&m->waiters);
+  if (m->owner != NULL) {
+    lwp_unpark(m->owner);
+  }
+
+  // A waiter that times out is no longer on c, and has to line up for m
+  // like anybody else.
+  int signalled = wq_block_timed(&c->waiters, ns);
+  if (!signalled) {
+    lwp_mutex_lock(m);
+  }
+  lwp_preempt_enable();
+
+  return signalled;
+}
+
+// Wakes the oldest waiter, if there is one. If the mutex is free it goes to
+// the waiter straight away; otherwise the waiter is moved onto the mutex's
+// queue rather than being run just to block again.
+// @param c The condition variable.
+// @return void.
+void lwp_cond_signal(lwp_cond *c) {
+  lwp_preempt_disable();
+
+  thread t = wq_pop(&c->waiters);
+  if (t != NULL) {
+    lwp_mutex *m = c->mutex;
+    if (m->owner == NULL) {
+      m->owner = t;
+      lwp_unpark(t);
+    }
+    else {
+      wq_push(&m->waiters, t);
+    }
+  }
+
+  lwp_preempt_enable();
+}
+
+// Wakes every waiter (in the order they started waiting).
+// @param c The condition variable.
+// @return void.
+void lwp_cond_broadcast(lwp_cond *c) {
+  lwp_preempt_disable();
+  while (c->waiters.head != NULL) {
+    lwp_cond_signal(c);
+  }
+  lwp_preempt_enable();
+}
+
+
+// === SEMAPHORE FUNCTIONS ===================================================
+// Initializes a semaphore.
+// @param s The semaphore.
+// @param count The initial count.
+// @return void.
+void lwp_sem_init(lwp_sem *s, unsigned int count) {
+  s->count = count;
+  s->waiters.head = NULL;
+  s->waiters.tail = NULL;
+}
+
+// Takes one from the count, parking until there is one to take.
+// @param s The semaphore.
+// @return void.
+void lwp_sem_wait(lwp_sem *s) {
+  lwp_preempt_disable();
+  if (s->count > 0) {
+    s->count--;
+  }
+  else {
+    // lwp_sem_post() hands its unit to us directly.
+    wq_block(&s->waiters);
+  }
+  lwp_preempt_enable();
+}
+
+// Takes one from the count if it is above zero.
+// @param s The semaphore.
+// @return TRUE if we took one, FALSE if the count was zero.
+int lwp_sem_trywait(lwp_sem *s) {
+  int got = FALSE;
+
+  lwp_preempt_disable();
+  if (s->count > 0) {
+    s->count--;
+    got = TRUE;
+  }
+  lwp_preempt_enable();
+
+  return got;
+}
+
+// Takes one from the count, parking for at most ns nanoseconds until there is
+// one to take.
+// @param s The semaphore.
+// @param ns How long to wait.
+// @return TRUE if we took one, FALSE if we timed out.
+int lwp_sem_timedwait(lwp_sem *s, long long ns) {
+  int got = TRUE;
+
+  lwp_preempt_disable();
+  if (s->count > 0) {
+    s->count--;
+  }
+  else {
+    got = wq_block_timed(&s->waiters, ns);
+  }
+  lwp_preempt_enable();
+
+  return got;
+}
+
+// Adds one to the count, or gives it to the oldest waiter if there is one.
+// @param s The semaphore.
+// @return void.
+void lwp_sem_post(lwp_sem *s) {
+  lwp_preempt_disable();
+  thread t = wq_pop(&s->waiters);
+  if (t != NULL) {
+    lwp_unpark(t);
+  }
+  else {
+    s->count++;
+  }
+  lwp_preempt_enable();
+}
+
+
+// === BARRIER FUNCTIONS =====================================================
+// Initializes a barrier.
+// @param b The barrier.
+// @param count How many threads have to arrive before any of them leave.
+// @return void.
+void lwp_barrier_init(lwp_barrier *b, unsigned int count) {
+  b->count = (count == 0) ? 1 : count;
+  b->arrived = 0;
+  b->waiters.head = NULL;
+  b->waiters.tail = NULL;
+}
+
+// Parks until count threads have arrived, then lets them all go. The barrier
+// is ready for the next round as soon as it opens.
+// @param b The barrier.
+// @return LWP_BARRIER_SERIAL for the last thread to arrive, 0 for the rest.
+int lwp_barrier_wait(lwp_barrier *b) {
+  lwp_preempt_disable();
+
+  b->arrived++;
+  if (b->arrived < b->count) {
+    wq_block(&b->waiters);
+    lwp_preempt_enable();
+    return 0;
+  }
+
+  b->arrived = 0;
+  thread t = wq_pop(&b->waiters);
+  while (t != NULL) {
+    lwp_unpark(t);
+    t = wq_pop(&b->waiters);
+  }
+
+  lwp_preempt_enable();
+  return LWP_BARRIER_SERIAL;
+}
+
+
+// === QUEUE HELPER FUNCTIONS ================================================
+// Adds a thread to the back of a wait queue.
+// @param q The queue.
+// @param t The thread.
+// @return void.
+static void wq_push(lwp_waitq *q, thread t) {
+  t->wait_next = NULL;
+  if (q->head == NULL) {
+    q->head = t;
+  }
+  else {
+    q->tail->wait_next = t;
+  }
+  q->tail = t;
+}
+
+// Takes the thread at the front of a wait queue.
+// @param q The queue.
+// @return The thread, or NULL if the queue is empty.
+static thread wq_pop(lwp_waitq *q) {
+  thread t = q->head;
+  if (t != NULL) {
+    q->head = t->wait_next;
+    if (q->head == NULL) {
+      q->tail = NULL;
+    }
+    t->wait_next = NULL;
+  }
+  return t;
+}
+
+// Queues the calling thread and parks it. The caller has preemption masked,
+// so nobody can look at the queue before we are off the run queue.
+// @param q The queue.
+// @return void.
+static void wq_block(lwp_waitq *q) {
+  wq_push(q, lwp_self());
+  lwp_park();
+}
+
+// Queues the calling thread and parks it, with a timer that takes it off the
+// queue again if nobody wakes it in time. The caller has preemption masked.
+// @param q The queue.
+// @param ns How long to wait (nothing is queued if this isn't positive).
+// @return TRUE if we were woken, FALSE if we timed out.
+static int wq_block_timed(lwp_waitq *q, long long ns) {
+  if (ns <= 0) {
+    return FALSE;
+  }
+
+  wq_timeout to;
+  to.timer.fire = wq_timeout_fire;
+  to.q = q;
+  to.self = lwp_self();
+  to.timed_out = FALSE;
+
+  lwp_timer_add(&to.timer, lwp_now() + ns);
+  wq_block(q);
+  lwp_timer_cancel(&to.timer);
+
+  return !to.timed_out;
+}
+
+// Takes a thread out of a wait queue, wherever it is.
+// @param q The queue.
+// @param t The thread.
+// @return TRUE if it was there, FALSE if not.
+static int wq_remove(lwp_waitq *q, thread t) {
+  thread prev = NULL;
+  thread cur = q->head;
+
+  while (cur != NULL && cur != t) {
+    prev = cur;
+    cur = cur->wait_next;
+  }
+  if (cur == NULL) {
+    return FALSE;
+  }
+
+  if (prev == NULL) {
+    q->head = t->wait_next;
+  }
+  else {
+    prev->wait_next = t->wait_next;
+  }
+  if (q->tail == t) {
+    q->tail = prev;
+  }
+  t->wait_next = NULL;
+
+  return TRUE;
+}
+
+// Called by the timer wheel when a timed wait runs out. If the waiter has
+// already been handed what it was waiting for (and taken off the queue), it
+// is left alone.
+// @param t The waiter's timer.
+// @return void.
+static void wq_timeout_fire(lwp_timer *t) {
+  wq_timeout *to = (wq_timeout *)t;
+
+  if (wq_remove(to->q, to->self)) {
+    to->timed_out = TRUE;
+    lwp_unpark(to->self);
+  }
+}
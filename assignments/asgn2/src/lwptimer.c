@@ -0,0 +1,284 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "lwptimer.h"
+
+// === MACROS ================================================================
+// The wheel's resolution. A timer fires on the first tick at or after its
+// deadline, so this is also how late it can be (plus scheduling).
+#define TW_TICK_NS 1000000LL // 1ms
+
+// Each level has 2^TW_BITS slots, and each slot of a level covers a whole
+// turn of the level below it.
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_LEVELS 4
+
+// The furthest out (in ticks) the wheel can hold: about 4.6 hours. Later
+// timers are parked at the far end and put back when they get there.
+#define TW_SPAN (1LL << (TW_BITS * TW_LEVELS))
+
+
+// === HELPER FUNCTIONS ======================================================
+// Puts an armed timer in the slot its deadline belongs to.
+static void tw_insert(lwp_timer *t);
+// Takes a timer out of its slot.
+static void tw_unlink(lwp_timer *t);
+// Moves the timers in one slot of an upper level down to where they go now.
+static void tw_cascade(int level);
+// Unparks the thread sleeping on a timer.
+static void sleep_fire(lwp_timer *t);
+
+
+// === DATA DEFINITIONS ======================================================
+// A timer used by lwp_sleep().
+typedef struct sleeper {
+  lwp_timer timer;              // must be first
+  thread    self;
+} sleeper;
+
+
+// === GLOBAL VARIABLES ======================================================
+// The slots, and how many timers each level holds.
+static lwp_timer *wheel[TW_LEVELS][TW_SLOTS];
+static int level_count[TW_LEVELS];
+
+// How many timers are armed.
+static int armed = 0;
+
+// The last tick the wheel has been run up to.
+static long long cur_tick = 0;
+
+
+// === SLEEP FUNCTIONS =======================================================
+// Parks the calling LWP until at least ns nanoseconds have gone by.
+// @param ns How long to sleep.
+// @return void.
+void lwp_sleep(long long ns) {
+  if (ns <= 0) {
+    lwp_yield();
+    return;
+  }
+
+  sleeper s;
+  s.timer.fire = sleep_fire;
+  s.self = lwp_self();
+
+  // Arming and parking can't be split up by a tick.
+  lwp_preempt_disable();
+  lwp_timer_add(&s.timer, lwp_now() + ns);
+  lwp_park();
+  lwp_preempt_enable();
+}
+
+// Reads the monotonic clock.
+// @param void.
+// @return The time in nanoseconds.
+long long lwp_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+// === TIMER FUNCTIONS =======================================================
+// Arms a timer. The caller has preemption masked.
+// @param t The timer (fire must be set).
+// @param deadline When to fire it, in lwp_now() time.
+// @return void.
+void lwp_timer_add(lwp_timer *t, long long deadline) {
+  // An empty wheel may not have been run in a while; start it from now.
+  if (armed == 0) {
+    cur_tick = lwp_now() / TW_TICK_NS;
+  }
+
+  t->deadline = deadline;
+  t->pending = TRUE;
+  tw_insert(t);
+  armed++;
+}
+
+// Disarms a timer if it hasn't fired yet. The caller has preemption masked.
+// @param t The timer.
+// @return void.
+void lwp_timer_cancel(lwp_timer *t) {
+  if (!t->pending) {
+    return;
+  }
+
+  tw_unlink(t);
+  t->pending = FALSE;
+  armed--;
+}
+
+// Runs the wheel up to now, firing every timer that is due. When the lowest
+// level is empty there is nothing to fire until the next cascade, so the
+// wheel skips straight there.
+// @param void.
+// @return The number of timers fired.
+int lwp_timer_expire(void) {
+  int fired = 0;
+
+  if (armed == 0) {
+    return 0;
+  }
+
+  long long now = lwp_now();
+  long long now_tick = now / TW_TICK_NS;
+
+  while (cur_tick < now_tick && armed > 0) {
+    if (level_count[0] == 0) {
+      long long turn = (cur_tick | TW_MASK) + 1;
+      cur_tick = (turn <= now_tick) ? turn - 1 : now_tick;
+      if (cur_tick == now_tick) {
+        break;
+      }
+    }
+
+    cur_tick++;
+
+    // At the start of each turn of a level, the slot above it comes down.
+    int level = 0;
+    while (level + 1 < TW_LEVELS &&
+        ((cur_tick >> (TW_BITS * level)) & TW_MASK) == 0) {
+      level++;
+      tw_cascade(level);
+    }
+
+    lwp_timer **slot = &wheel[0][cur_tick & TW_MASK];
+    while (*slot != NULL) {
+      lwp_timer *t = *slot;
+      tw_unlink(t);
+
+      // Timers too far out for the wheel come around early; put them back.
+      if (t->deadline > now) {
+        tw_insert(t);
+        continue;
+      }
+
+      t->pending = FALSE;
+      armed--;
+      fired++;
+      t->fire(t);
+    }
+  }
+
+  return fired;
+}
+
+// Works out how long until the wheel next has something to do: the next
+// non-empty slot of the lowest level, or the next cascade of the lowest
+// non-empty level above it.
+// @param void.
+// @return Nanoseconds to wait, 0 if something is due, or -1 if nothing is
+// armed.
+long long lwp_timer_wait_ns(void) {
+  if (armed == 0) {
+    return -1;
+  }
+
+  long long due = -1;
+  if (level_count[0] > 0) {
+    long long i;
+    for (i = 1; i <= TW_SLOTS && due < 0; i++) {
+      if (wheel[0][(cur_tick + i) & TW_MASK] != NULL) {
+        due = cur_tick + i;
+      }
+    }
+  }
+  else {
+    int level;
+    for (level = 1; level < TW_LEVELS && due < 0; level++) {
+      if (level_count[level] > 0) {
+        int shift = TW_BITS * level;
+        due = ((cur_tick >> shift) + 1) << shift;
+      }
+    }
+  }
+
+  long long wait = due * TW_TICK_NS - lwp_now();
+  return (wait < 0) ? 0 : wait;
+}
+
+
+// === WHEEL HELPER FUNCTIONS ================================================
+// Puts a timer in the slot for its deadline: the lowest level whose turn
+// covers it. Deadlines that have already passed go in the next tick.
+// @param t The timer.
+// @return void.
+static void tw_insert(lwp_timer *t) {
+  // Round up, so a timer never fires before its deadline.
+  long long expires = (t->deadline + TW_TICK_NS - 1) / TW_TICK_NS;
+  if (expires <= cur_tick) {
+    expires = cur_tick + 1;
+  }
+  if (expires - cur_tick >= TW_SPAN) {
+    expires = cur_tick + TW_SPAN - 1;
+  }
+
+  long long delta = expires - cur_tick;
+  int level = 0;
+  while (level + 1 < TW_LEVELS && delta >= (1LL << (TW_BITS * (level + 1)))) {
+    level++;
+  }
+
+  int idx = (expires >> (TW_BITS * level)) & TW_MASK;
+  lwp_timer **slot = &wheel[level][idx];
+
+  t->prev = NULL;
+  t->next = *slot;
+  if (*slot != NULL) {
+    (*slot)->prev = t;
+  }
+  *slot = t;
+  level_count[level]++;
+
+  t->level = level;
+  t->slot = idx;
+}
+
+// Takes a timer out of its slot.
+// @param t The timer.
+// @return void.
+static void tw_unlink(lwp_timer *t) {
+  lwp_timer **slot = &wheel[t->level][t->slot];
+
+  if (t->prev != NULL) {
+    t->prev->next = t->next;
+  }
+  else {
+    *slot = t->next;
+  }
+  if (t->next != NULL) {
+    t->next->prev = t->prev;
+  }
+
+  t->next = NULL;
+  t->prev = NULL;
+  level_count[t->level]--;
+}
+
+// Empties the slot of a level that the current tick has just reached, and
+// files its timers again (they all land lower down).
+// @param level The level (1 or more).
+// @return void.
+static void tw_cascade(int level) {
+  int idx = (cur_tick >> (TW_BITS * level)) & TW_MASK;
+  lwp_timer *t = wheel[level][idx];
+
+  while (t != NULL) {
+    lwp_timer *next = t->next;
+    tw_unlink(t);
+    tw_insert(t);
+    t = next;
+  }
+}
+
+// Wakes the thread that went to sleep on a timer.
+// @param t The sleeper's timer.
+// @return void.
+static void sleep_fire(lwp_timer *t) {
+  lwp_unpark(((sleeper *)t)->self);
+}
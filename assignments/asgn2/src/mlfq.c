@@ -0,0 +1,334 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "mlfq.h"
+
+// === MACROS ================================================================
+// The links in a level's FIFO.
+#define NEXT sched_one
+#define PREV sched_two
+
+// What we keep in each thread's sched_data.
+#define MLFQ_TAG   0            // &mlfq_publish once we've set the rest up
+#define MLFQ_LEVEL 1            // 0 is the top
+#define MLFQ_USED  2            // ns used at this level so far
+#define MLFQ_EPOCH 3            // boosts seen, to tell if it was boosted since
+
+// The number of levels (at most the bits in the bitmap).
+#define MLFQ_LEVELS 8
+
+// How much CPU time a thread gets at the top level before it is demoted.
+// Each level down doubles it.
+#define MLFQ_ALLOT_NS 2000000LL // 2ms
+
+// How often every thread is put back on the top level.
+#define MLFQ_BOOST_NS 100000000LL // 100ms
+
+
+// === HELPER FUNCTIONS ======================================================
+// Starts a new epoch, so threads coming back from another scheduler start
+// at the top.
+static void mlfq_init(void);
+// Adds a thread to the pool.
+static void mlfq_admit(thread new);
+// Removes a thread from the pool.
+static void mlfq_remove(thread victim);
+// Gets the first thread of the highest non-empty level.
+static thread mlfq_next(void);
+// The number of threads in the pool.
+static int mlfq_qlen(void);
+// The slice (in ticks) a thread gets at its level.
+static unsigned int mlfq_quantum(thread next);
+// Carries on from a thread lwp_yield_to() picked.
+static void mlfq_picked(thread next);
+// Charges the running thread and moves it down a level if it is demoted.
+static void mlfq_stop(long long now);
+// Gets the level a thread is on, catching up on any boost it missed.
+static int mlfq_level(thread t);
+// Charges the running thread for the time since it was picked.
+static int mlfq_charge(thread t, long long now);
+// Adds a thread to the back of a level.
+static void mlfq_push(int level, thread t);
+// Takes a thread out of a level.
+static void mlfq_unlink(int level, thread t);
+// Moves every thread to the top level.
+static void mlfq_boost(long long now);
+// Reads the monotonic clock.
+static long long mlfq_now(void);
+
+
+// === GLOBAL VARIABLES ======================================================
+// The actual struct that holds all of the pointers to the functions.
+static struct scheduler mlfq_publish = {
+  .init=mlfq_init,
+  .shutdown=NULL,
+  .admit=mlfq_admit,
+  .remove=mlfq_remove,
+  .next=mlfq_next,
+  .qlen=mlfq_qlen,
+  .quantum=mlfq_quantum,
+  .picked=mlfq_picked
+};
+
+// The global MLFQ pointer that will be referenced.
+scheduler MLFQ = &mlfq_publish;
+
+// One FIFO per level, and a bit per level that has anybody on it.
+static thread heads[MLFQ_LEVELS];
+static thread tails[MLFQ_LEVELS];
+static unsigned int nonempty = 0;
+static int count = 0;
+
+// The thread next() last handed out, and when.
+static thread running = NULL;
+static long long picked_at = 0;
+
+// How many boosts there have been, and when the last one was.
+static long long epoch = 0;
+static long long last_boost = 0;
+
+
+// === SCHEDULER FUNCTIONS ===================================================
+// Called by lwp_set_scheduler() before the threads are moved over. A thread
+// that was in the pool once before still has its old level in sched_data, so
+// being installed counts as a boost: a new epoch makes every level read as 0.
+// The pool is empty here, so there is nothing to splice.
+// @param void.
+// @return void.
+static void mlfq_init(void) {
+  epoch++;
+  running = NULL;
+}
+
+// Adds a thread to the back of its level. New threads (or ones that come
+// from another scheduler) start at the top.
+// @param new The new thread that is going to be added to the pool.
+// @return void.
+static void mlfq_admit(thread new) {
+  if (new->sched_data[MLFQ_TAG] != (long long)(intptr_t)&mlfq_publish) {
+    new->sched_data[MLFQ_TAG] = (long long)(intptr_t)&mlfq_publish;
+    new->sched_data[MLFQ_LEVEL] = 0;
+    new->sched_data[MLFQ_USED] = 0;
+    new->sched_data[MLFQ_EPOCH] = epoch;
+  }
+
+  mlfq_push(mlfq_level(new), new);
+  count++;
+}
+
+// Takes a thread out of the pool. If it was running, it is charged for the
+// time it ran, so blocking doesn't reset what it has used.
+// @param victim The thread we are removing from the schedulers pool.
+// @return void.
+static void mlfq_remove(thread victim) {
+  mlfq_unlink(mlfq_level(victim), victim);
+  count--;
+
+  if (victim == running) {
+    mlfq_charge(victim, mlfq_now());
+    running = NULL;
+  }
+}
+
+// Charges the thread that was running (demoting it if it used up its
+// allotment), boosts everyone if it is time, and then picks the first thread
+// on the highest non-empty level. That thread goes to the back of its level,
+// so threads on the same level take turns.
+// @param void.
+// @return thread The next thread to run, or NULL if the pool is empty.
+static thread mlfq_next(void) {
+  long long now = mlfq_now();
+
+  mlfq_stop(now);
+
+  if (now - last_boost >= MLFQ_BOOST_NS) {
+    mlfq_boost(now);
+  }
+
+  if (nonempty == 0) {
+    running = NULL;
+    return NULL;
+  }
+
+  int level = __builtin_ctz(nonempty);
+  thread next = heads[level];
+  if (next->NEXT != NULL) {
+    mlfq_unlink(level, next);
+    mlfq_push(level, next);
+  }
+
+  running = next;
+  picked_at = now;
+  return next;
+}
+
+// Return the number of runnable threads.
+// @param void.
+// @return int The number of threads in our scheduling pool.
+static int mlfq_qlen(void) {
+  return count;
+}
+
+// A thread was run out of turn (by lwp_yield_to()). Whoever was running is
+// charged as usual, and the thread goes to the back of its level and is
+// charged from now on, as if next() had picked it.
+// @param next The thread being run.
+// @return void.
+static void mlfq_picked(thread next) {
+  long long now = mlfq_now();
+
+  mlfq_stop(now);
+
+  if (next->NEXT != NULL) {
+    int level = mlfq_level(next);
+    mlfq_unlink(level, next);
+    mlfq_push(level, next);
+  }
+
+  running = next;
+  picked_at = now;
+}
+
+// Lower levels run longer before they are preempted: one more tick for each
+// level down.
+// @param next The thread about to run.
+// @return The slice in ticks.
+static unsigned int mlfq_quantum(thread next) {
+  return 1 + mlfq_level(next);
+}
+
+
+// === HELPER FUNCTIONS ======================================================
+// Gets the level a thread is on. A thread that was in the pool at a boost
+// was moved to the top along with its level's list, but its own fields were
+// left alone (so the boost stays O(levels)); they are caught up here.
+// @param t The thread.
+// @return Its level.
+static int mlfq_level(thread t) {
+  if (t->sched_data[MLFQ_EPOCH] != epoch) {
+    t->sched_data[MLFQ_EPOCH] = epoch;
+    t->sched_data[MLFQ_LEVEL] = 0;
+    t->sched_data[MLFQ_USED] = 0;
+  }
+  return (int)t->sched_data[MLFQ_LEVEL];
+}
+
+// Charges the thread that was running for its time, and moves it to the
+// back of the next level down if that demotes it.
+// @param now The time.
+// @return void.
+static void mlfq_stop(long long now) {
+  if (running != NULL) {
+    int level = mlfq_level(running);
+    if (mlfq_charge(running, now)) {
+      mlfq_unlink(level, running);
+      mlfq_push(level + 1, running);
+    }
+  }
+}
+
+// Adds the time since t was picked to what it has used at its level, and
+// demotes it once that reaches the level's allotment. The caller moves it to
+// its new level's list.
+// @param t The thread that was running.
+// @param now The time.
+// @return TRUE if it was demoted.
+static int mlfq_charge(thread t, long long now) {
+  int level = mlfq_level(t);
+
+  t->sched_data[MLFQ_USED] += now - picked_at;
+  picked_at = now;
+
+  if (level + 1 < MLFQ_LEVELS &&
+      t->sched_data[MLFQ_USED] >= (MLFQ_ALLOT_NS << level)) {
+    t->sched_data[MLFQ_LEVEL] = level + 1;
+    t->sched_data[MLFQ_USED] = 0;
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+// Appends a thread to a level's FIFO.
+// @param level The level.
+// @param t The thread.
+// @return void.
+static void mlfq_push(int level, thread t) {
+  t->NEXT = NULL;
+  t->PREV = tails[level];
+
+  if (tails[level] != NULL) {
+    tails[level]->NEXT = t;
+  }
+  else {
+    heads[level] = t;
+    nonempty |= 1u << level;
+  }
+  tails[level] = t;
+}
+
+// Takes a thread out of a level's FIFO.
+// @param level The level it is on.
+// @param t The thread.
+// @return void.
+static void mlfq_unlink(int level, thread t) {
+  if (t->PREV != NULL) {
+    t->PREV->NEXT = t->NEXT;
+  }
+  else {
+    heads[level] = t->NEXT;
+  }
+
+  if (t->NEXT != NULL) {
+    t->NEXT->PREV = t->PREV;
+  }
+  else {
+    tails[level] = t->PREV;
+  }
+
+  if (heads[level] == NULL) {
+    nonempty &= ~(1u << level);
+  }
+
+  // For my own sanity
+  t->NEXT = NULL;
+  t->PREV = NULL;
+}
+
+// Splices every level onto the end of the top one, in order, and starts a new
+// epoch so each thread's level reads as 0 from now on.
+// @param now The time.
+// @return void.
+static void mlfq_boost(long long now) {
+  int level;
+  for (level = 1; level < MLFQ_LEVELS; level++) {
+    if (heads[level] == NULL) {
+      continue;
+    }
+
+    if (tails[0] != NULL) {
+      tails[0]->NEXT = heads[level];
+      heads[level]->PREV = tails[0];
+    }
+    else {
+      heads[0] = heads[level];
+    }
+    tails[0] = tails[level];
+
+    heads[level] = NULL;
+    tails[level] = NULL;
+  }
+
+  nonempty = (heads[0] != NULL) ? 1u : 0u;
+  epoch++;
+  last_boost = now;
+}
+
+// Reads the monotonic clock.
+// @param void.
+// @return The time in nanoseconds.
+static long long mlfq_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
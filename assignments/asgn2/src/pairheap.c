@@ -0,0 +1,136 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "pairheap.h"
+
+// === MACROS ================================================================
+// The heap's links: a thread's leftmost child, and its next sibling.
+#define CHILD sched_one
+#define SIBLING sched_two
+
+// The thread behind the back link kept in sched_data.
+#define PREV_OF(t) ((thread)(intptr_t)(t)->sched_data[PH_PREV])
+#define SET_PREV(t, p) ((t)->sched_data[PH_PREV] = (long long)(intptr_t)(p))
+
+
+// === HELPER FUNCTIONS ======================================================
+// Links two heaps into one.
+static thread ph_meld(ph_heap *heap, thread a, thread b);
+// Melds a list of siblings pairwise (left to right, then right to left).
+static thread ph_merge_pairs(ph_heap *heap, thread first);
+
+
+// === PAIRING HEAP FUNCTIONS ================================================
+// Puts a thread in the heap on its own and melds it with the root.
+// @param heap The heap.
+// @param t The thread.
+// @return void.
+void ph_insert(ph_heap *heap, thread t) {
+  t->CHILD = NULL;
+  t->SIBLING = NULL;
+  SET_PREV(t, NULL);
+  heap->root = ph_meld(heap, heap->root, t);
+}
+
+// Takes a thread out of the heap. The root's children are merged into the
+// new root; anybody else is cut from its parent, and its children merged
+// and melded back in.
+// @param heap The heap.
+// @param t The thread (in the heap).
+// @return void.
+void ph_delete(ph_heap *heap, thread t) {
+  if (t == heap->root) {
+    heap->root = ph_merge_pairs(heap, t->CHILD);
+  }
+  else {
+    thread prev = PREV_OF(t);
+    if (prev->CHILD == t) {
+      prev->CHILD = t->SIBLING;
+    }
+    else {
+      prev->SIBLING = t->SIBLING;
+    }
+    if (t->SIBLING != NULL) {
+      SET_PREV(t->SIBLING, prev);
+    }
+
+    heap->root = ph_meld(heap, heap->root, ph_merge_pairs(heap, t->CHILD));
+  }
+
+  // For my own sanity
+  t->CHILD = NULL;
+  t->SIBLING = NULL;
+  SET_PREV(t, NULL);
+}
+
+
+// === HELPER FUNCTIONS ======================================================
+// Links two heaps: the root that comes out later becomes the leftmost child
+// of the other. Ties go to a.
+// @param heap The heap they belong to (for its order).
+// @param a A heap (or NULL).
+// @param b Another heap (or NULL).
+// @return The root of the combined heap.
+static thread ph_meld(ph_heap *heap, thread a, thread b) {
+  if (a == NULL) {
+    return b;
+  }
+  if (b == NULL) {
+    return a;
+  }
+
+  if (heap->before(b, a)) {
+    thread swap = a;
+    a = b;
+    b = swap;
+  }
+
+  b->SIBLING = a->CHILD;
+  if (a->CHILD != NULL) {
+    SET_PREV(a->CHILD, b);
+  }
+  SET_PREV(b, a);
+  a->CHILD = b;
+
+  a->SIBLING = NULL;
+  SET_PREV(a, NULL);
+  return a;
+}
+
+// The standard two-pass merge: meld siblings in pairs from left to right,
+// then meld the pairs together from right to left.
+// @param heap The heap they belong to.
+// @param first The leftmost sibling (or NULL).
+// @return The root of the merged heap.
+static thread ph_merge_pairs(ph_heap *heap, thread first) {
+  // First pass: meld each pair, and chain the results (newest first)
+  // through SIBLING.
+  thread pairs = NULL;
+  while (first != NULL) {
+    thread a = first;
+    thread b = a->SIBLING;
+    first = (b != NULL) ? b->SIBLING : NULL;
+
+    a->SIBLING = NULL;
+    if (b != NULL) {
+      b->SIBLING = NULL;
+    }
+
+    thread m = ph_meld(heap, a, b);
+    m->SIBLING = pairs;
+    pairs = m;
+  }
+
+  // Second pass: meld them together, rightmost pair first.
+  thread merged = NULL;
+  while (pairs != NULL) {
+    thread p = pairs;
+    pairs = p->SIBLING;
+    p->SIBLING = NULL;
+    merged = ph_meld(heap, merged, p);
+  }
+
+  if (merged != NULL) {
+    SET_PREV(merged, NULL);
+  }
+  return merged;
+}
@@ -0,0 +1,232 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "stride.h"
+#include "pairheap.h"
+
+// === MACROS ================================================================
+// What we keep in each thread's sched_data (the heap has PH_PREV). The
+// tickets are in the thread itself, as they outlive any one install.
+#define STRIDE_TAG     0        // this install's tag once we've set it up
+#define STRIDE_PASS    1        // in the heap: its pass. Out: pass - vtime
+
+
+// === HELPER FUNCTIONS ======================================================
+// Gives this install its own tag.
+static void stride_init(void);
+// Adds a thread to the heap.
+static void stride_admit(thread new);
+// Removes a thread from the heap.
+static void stride_remove(thread victim);
+// Gets the thread with the smallest pass.
+static thread stride_next(void);
+// The number of threads in the heap.
+static int stride_qlen(void);
+// Carries on from a thread lwp_yield_to() picked.
+static void stride_picked(thread next);
+// Sets up sched_data for a thread we haven't seen yet.
+static void stride_claim(thread t);
+// Moves the running thread's pass on by the time it has run.
+static void stride_charge(thread t, long long now);
+// Orders the heap by pass.
+static int stride_before(thread a, thread b);
+// Reads the monotonic clock.
+static long long stride_now(void);
+
+
+// === GLOBAL VARIABLES ======================================================
+// The actual struct that holds all of the pointers to the functions.
+static struct scheduler stride_publish = {
+  .init=stride_init,
+  .shutdown=NULL,
+  .admit=stride_admit,
+  .remove=stride_remove,
+  .next=stride_next,
+  .qlen=stride_qlen,
+  .quantum=NULL,
+  .picked=stride_picked
+};
+
+// The global Stride pointer that will be referenced.
+scheduler Stride = &stride_publish;
+
+// What marks a thread's sched_data as set up by this install: our address,
+// with how many times we have been installed above the bits a pointer uses.
+static long long tag = 0;
+static long long installs = 0;
+
+// The heap, and how many threads are in it.
+static ph_heap heap = { NULL, stride_before };
+static int count = 0;
+
+// The pass of the last thread picked. Threads joining are placed relative
+// to it.
+static long long vtime = 0;
+
+// The thread next() last handed out, and when.
+static thread running = NULL;
+static long long picked_at = 0;
+
+
+// === SCHEDULER FUNCTIONS ===================================================
+// Called by lwp_set_scheduler() before the threads are moved over. Whatever
+// a thread had in sched_data from an earlier install may have been written
+// over since, so a new tag makes stride_claim() set every thread up afresh.
+// @param void.
+// @return void.
+static void stride_init(void) {
+  installs++;
+  tag = (installs << 48) | (long long)(intptr_t)&stride_publish;
+}
+
+// Adds a thread to the heap, as far ahead of the others as it was when it
+// left (level with them, if it's new).
+// @param new The new thread that is going to be added to the pool.
+// @return void.
+static void stride_admit(thread new) {
+  stride_claim(new);
+
+  new->sched_data[STRIDE_PASS] += vtime;
+  ph_insert(&heap, new);
+  count++;
+}
+
+// Takes a thread out of the heap, charging it first if it was running.
+// @param victim The thread we are removing from the schedulers pool.
+// @return void.
+static void stride_remove(thread victim) {
+  ph_delete(&heap, victim);
+  count--;
+
+  if (victim == running) {
+    stride_charge(victim, stride_now());
+    running = NULL;
+  }
+
+  // Remember where it was relative to everyone else.
+  victim->sched_data[STRIDE_PASS] -= vtime;
+}
+
+// Charges the thread that was running for the time it ran, then picks the
+// thread with the smallest pass. It stays in the heap.
+// @param void.
+// @return thread The next thread to run, or NULL if the pool is empty.
+static thread stride_next(void) {
+  long long now = stride_now();
+
+  if (running != NULL) {
+    ph_delete(&heap, running);
+    stride_charge(running, now);
+    ph_insert(&heap, running);
+  }
+
+  running = heap.root;
+  picked_at = now;
+  if (heap.root != NULL) {
+    vtime = heap.root->sched_data[STRIDE_PASS];
+  }
+
+  return heap.root;
+}
+
+// Return the number of runnable threads.
+// @param void.
+// @return int The number of threads in our scheduling pool.
+static int stride_qlen(void) {
+  return count;
+}
+
+// A thread was run out of turn (by lwp_yield_to()). Whoever was running is
+// charged, and the thread is charged from now on for the time it runs, so
+// running early only moves its pass on sooner: it still gets its share and
+// no more.
+// @param next The thread being run.
+// @return void.
+static void stride_picked(thread next) {
+  long long now = stride_now();
+
+  if (running != NULL) {
+    ph_delete(&heap, running);
+    stride_charge(running, now);
+    ph_insert(&heap, running);
+  }
+
+  running = next;
+  picked_at = now;
+  vtime = heap.root->sched_data[STRIDE_PASS];
+}
+
+
+// === TICKET FUNCTIONS ======================================================
+// Sets how many tickets a thread holds. They go in the thread's own tickets
+// field, which no other scheduler touches, so they hold whichever scheduler
+// has the thread right now, and go away with it.
+// @param tid The thread.
+// @param tickets How many (clamped to 1 .. STRIDE_ONE).
+// @return 0, or -1 if there is no such thread.
+int stride_set_tickets(tid_t tid, unsigned int tickets) {
+  if (tickets < 1) {
+    tickets = 1;
+  }
+  if (tickets > STRIDE_ONE) {
+    tickets = STRIDE_ONE;
+  }
+
+  lwp_preempt_disable();
+  thread t = tid2thread(tid);
+  if (t == NULL) {
+    lwp_preempt_enable();
+    return -1;
+  }
+  t->tickets = tickets;
+  lwp_preempt_enable();
+
+  return 0;
+}
+
+
+// === HELPER FUNCTIONS ======================================================
+// Gives a thread a level start, unless we've set it up already (it may have
+// come from another scheduler, which used sched_data for something else).
+// @param t The thread.
+// @return void.
+static void stride_claim(thread t) {
+  if (t->sched_data[STRIDE_TAG] != tag) {
+    t->sched_data[STRIDE_TAG] = tag;
+    t->sched_data[STRIDE_PASS] = 0;
+  }
+}
+
+// Moves a thread's pass on by its stride for every nanosecond it has run
+// since it was picked (at least one, so a thread that yields right away
+// still moves). A thread never given tickets holds the default.
+// @param t The thread that was running (out of the heap).
+// @param now The time.
+// @return void.
+static void stride_charge(thread t, long long now) {
+  long long ran = now - picked_at;
+  if (ran < 1) {
+    ran = 1;
+  }
+
+  long long tickets = (t->tickets != 0) ? t->tickets : STRIDE_DEFAULT_TICKETS;
+  t->sched_data[STRIDE_PASS] += ran * (STRIDE_ONE / tickets);
+  picked_at = now;
+}
+
+// Says whether one thread comes out of the heap ahead of another.
+// @param a A thread.
+// @param b Another.
+// @return TRUE if a's pass is smaller.
+static int stride_before(thread a, thread b) {
+  return a->sched_data[STRIDE_PASS] < b->sched_data[STRIDE_PASS];
+}
+
+// Reads the monotonic clock.
+// @param void.
+// @return The time in nanoseconds.
+static long long stride_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
@@ -0,0 +1,305 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "workstealing.h"
+
+// === MACROS ================================================================
+// The number of slots a deque starts with. It doubles whenever it fills.
+#define WS_INITIAL_SIZE 64
+
+// Index used by a pthread that is not bound to any worker (for example the
+// original thread admitting threads before lwp_start()).
+#define WS_UNBOUND -1
+
+
+// === DATA DEFINITIONS ======================================================
+// A circular array of threads. The size is always a power of two.
+typedef struct ws_array {
+  long size;
+  struct ws_array *retired;      // older arrays kept alive until teardown
+  _Atomic(thread) buf[];
+} ws_array;
+
+// A work-stealing deque, Chase-Lev's push and steal without its pop (see
+// workstealing.h). Only the owning worker pushes at the bottom; anyone
+// (including the owner) takes from the top.
+typedef struct ws_deque {
+  atomic_long top;
+  char pad[64 - sizeof(atomic_long)]; // keep top and bottom on their own lines
+  atomic_long bottom;
+  _Atomic(ws_array *) array;
+} ws_deque;
+
+
+// === HELPER FUNCTIONS ======================================================
+// Adds a thread to the calling worker's deque.
+static void ws_admit(thread new);
+// Nothing to do: threads leave a deque when next() hands them out.
+static void ws_remove(thread victim);
+// Takes a thread from the calling worker's deque, or steals one.
+static thread ws_next(void);
+// Approximates the number of runnable threads across all deques.
+static int ws_qlen(void);
+// Pushes a thread onto the bottom of a deque (owner only).
+static void ws_push(ws_deque *q, thread t);
+// Takes a thread from the top of a deque. Returns NULL when it is empty or
+// when another worker won the race for the same slot.
+static thread ws_steal(ws_deque *q, int *aborted);
+// Doubles the array that backs a deque.
+static ws_array *ws_grow(ws_deque *q, ws_array *a, long top, long bottom);
+
+
+// === GLOBAL VARIABLES ======================================================
+// The actual struct that holds all of the pointers to the functions.
+static struct scheduler ws_publish = {
+  .init=NULL,
+  .shutdown=NULL,
+  .admit=ws_admit,
+  .remove=ws_remove,
+  .next=ws_next,
+  .qlen=ws_qlen
+};
+
+// The global WorkStealing pointer that will be referenced.
+scheduler WorkStealing = &ws_publish;
+
+// One deque per worker.
+static ws_deque *deques = NULL;
+static int ndeques = 0;
+
+// Which deque the calling pthread owns.
+static __thread int self = WS_UNBOUND;
+
+// Seed for picking victims. Each pthread has its own.
+static __thread unsigned int seed = 0;
+
+// Admits made by unbound pthreads are dealt out to the workers in turn.
+static int deal = 0;
+
+
+// === SETUP FUNCTIONS =======================================================
+// Allocates one deque per worker.
+// @param nworkers The number of workers that will pull from the deques.
+// @return void.
+void ws_setup(int nworkers) {
+  deques = calloc(nworkers, sizeof(ws_deque));
+  if (deques == NULL) {
+    perror("[ws_setup] Error when calloc()ing the deques.");
+    exit(EXIT_FAILURE);
+  }
+  ndeques = nworkers;
+
+  int i;
+  for (i = 0; i < nworkers; i++) {
+    ws_array *a = malloc(sizeof(ws_array) + WS_INITIAL_SIZE * sizeof(thread));
+    if (a == NULL) {
+      perror("[ws_setup] Error when malloc()ing a deque array.");
+      exit(EXIT_FAILURE);
+    }
+    a->size = WS_INITIAL_SIZE;
+    a->retired = NULL;
+    atomic_init(&deques[i].top, 0);
+    atomic_init(&deques[i].bottom, 0);
+    atomic_init(&deques[i].array, a);
+  }
+  deal = 0;
+}
+
+// Binds the calling pthread to a deque.
+// @param id The index of the deque this pthread owns.
+// @return void.
+void ws_bind(int id) {
+  self = id;
+  seed = (unsigned int)id * 2654435761u + 1;
+}
+
+// Frees the deques. Every deque should be empty by now.
+// @param void.
+// @return void.
+void ws_teardown(void) {
+  int i;
+  for (i = 0; i < ndeques; i++) {
+    ws_array *a = atomic_load(&deques[i].array);
+    while (a != NULL) {
+      ws_array *older = a->retired;
+      free(a);
+      a = older;
+    }
+  }
+  free(deques);
+  deques = NULL;
+  ndeques = 0;
+  self = WS_UNBOUND;
+}
+
+
+// === SCHEDULER FUNCTIONS ===================================================
+// Adds a thread to the calling worker's deque. Threads admitted by a pthread
+// that isn't a worker are spread across the deques round robin.
+// @param new The new thread that is going to be added to the pool.
+// @return void.
+static void ws_admit(thread new) {
+  if (self != WS_UNBOUND) {
+    ws_push(&deques[self], new);
+    return;
+  }
+
+  // Only the original thread (before the workers exist) gets here, so
+  // pushing on somebody else's deque is safe.
+  ws_push(&deques[deal], new);
+  deal = (deal + 1) % ndeques;
+}
+
+// Threads are taken out of a deque by next(), so there is never anything left
+// to unlink here.
+// @param victim The thread we are removing from the schedulers pool.
+// @return void.
+static void ws_remove(thread victim) {
+  (void)victim;
+}
+
+// Gets the next thread for the calling worker. The worker's own deque is
+// drained from the top, which keeps lwp_yield() round robin within a worker
+// (taking from the bottom would hand the yielding thread straight back).
+// When it is empty, the other deques are tried starting from a random victim.
+// @param void.
+// @return thread The next thread to run, or NULL if none could be found.
+static thread ws_next(void) {
+  int aborted;
+  thread t;
+
+  if (ndeques == 0) {
+    return NULL;
+  }
+
+  if (self != WS_UNBOUND) {
+    do {
+      t = ws_steal(&deques[self], &aborted);
+    } while (t == NULL && aborted);
+
+    if (t != NULL) {
+      return t;
+    }
+  }
+
+  // Pick a victim at random (xorshift), then walk the rest in order.
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  int start = seed % ndeques;
+
+  int i;
+  for (i = 0; i < ndeques; i++) {
+    int victim = (start + i) % ndeques;
+    if (victim == self) {
+      continue;
+    }
+
+    do {
+      t = ws_steal(&deques[victim], &aborted);
+    } while (t == NULL && aborted);
+
+    if (t != NULL) {
+      return t;
+    }
+  }
+
+  return NULL;
+}
+
+// Return the number of runnable threads. This is only a snapshot; the deques
+// can change while they are being counted.
+// @param void.
+// @return int The number of threads in our scheduling pool.
+static int ws_qlen(void) {
+  int count = 0;
+
+  int i;
+  for (i = 0; i < ndeques; i++) {
+    long b = atomic_load(&deques[i].bottom);
+    long t = atomic_load(&deques[i].top);
+    if (b > t) {
+      count += (int)(b - t);
+    }
+  }
+
+  return count;
+}
+
+
+// === DEQUE FUNCTIONS =======================================================
+// Pushes a thread onto the bottom of a deque. Only the owner may call this.
+// @param q The deque.
+// @param t The thread to push.
+// @return void.
+static void ws_push(ws_deque *q, thread t) {
+  long b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+  long top = atomic_load_explicit(&q->top, memory_order_acquire);
+  ws_array *a = atomic_load_explicit(&q->array, memory_order_relaxed);
+
+  // Full. Grow before writing past the top.
+  if (b - top > a->size - 1) {
+    a = ws_grow(q, a, top, b);
+  }
+
+  atomic_store_explicit(&a->buf[b & (a->size - 1)], t, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+}
+
+// Takes a thread from the top of a deque.
+// @param q The deque.
+// @param aborted Set to TRUE if we lost a race and the caller should retry.
+// @return The thread, or NULL.
+static thread ws_steal(ws_deque *q, int *aborted) {
+  *aborted = FALSE;
+
+  long t = atomic_load_explicit(&q->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+
+  if (t >= b) {
+    return NULL;
+  }
+
+  ws_array *a = atomic_load_explicit(&q->array, memory_order_acquire);
+  thread x = atomic_load_explicit(&a->buf[t & (a->size - 1)],
+      memory_order_relaxed);
+
+  if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+        memory_order_seq_cst, memory_order_relaxed)) {
+    *aborted = TRUE;
+    return NULL;
+  }
+
+  return x;
+}
+
+// Doubles the size of a deque's array. The old array can still be read by
+// a thief that loaded it before the swap, so it is kept until teardown.
+// @param q The deque.
+// @param a The array currently in use.
+// @param top The top index seen by the owner.
+// @param bottom The bottom index seen by the owner.
+// @return The new array.
+static ws_array *ws_grow(ws_deque *q, ws_array *a, long top, long bottom) {
+  ws_array *bigger = malloc(sizeof(ws_array) + 2 * a->size * sizeof(thread));
+  if (bigger == NULL) {
+    perror("[ws_grow] Error when malloc()ing a bigger deque array.");
+    exit(EXIT_FAILURE);
+  }
+  bigger->size = 2 * a->size;
+  bigger->retired = a;
+
+  long i;
+  for (i = top; i < bottom; i++) {
+    thread t = atomic_load_explicit(&a->buf[i & (a->size - 1)],
+        memory_order_relaxed);
+    atomic_store_explicit(&bigger->buf[i & (bigger->size - 1)], t,
+        memory_order_relaxed);
+  }
+
+  atomic_store_explicit(&q->array, bigger, memory_order_release);
+  return bigger;
+}
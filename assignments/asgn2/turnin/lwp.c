@@ -1,11 +1,23 @@
 #include <stddef.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <sys/resource.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+#include <x86intrin.h>
 #include "lwp.h"
 #include "roundrobin.h"
+#include "workstealing.h"
+#include "lwptimer.h"
 
 // === MACROS ================================================================
 // These are the variable names in the given Thread struct.
@@ -20,6 +32,117 @@
 // Byte allignment for making the stacks
 #define BYTE_STACK_ALIGNMENT 16 // 16 bytes
 
+// Environment variable read by lwp_start() for the number of workers when
+// lwp_set_workers() hasn't been called.
+#define LWP_WORKERS_ENV "LWP_WORKERS"
+
+// lwp_create_many() maps stacks this many bytes' worth (at least one) at a
+// time.
+#define STACK_BATCH_BYTES (256UL * 1024 * 1024)
+
+// Contexts are carved out of slabs this big (at least),
+// each one starting on its own cache line.
+#define SLAB_BYTES (256 * 1024)
+#define CACHE_LINE 64
+
+// The control words a fresh process starts with (same as FPU_INIT).
+#define MXCSR_DEFAULT 0x1f80
+#define FCW_DEFAULT 0x037f
+
+// Voluntary switches only need the callee-saved registers, so they go through
+// swap_rfiles_fast. Build with -DLWP_FULL_SWITCH to save everything on every
+// switch instead (to compare the two).
+#ifdef LWP_FULL_SWITCH
+#define SWAP_VOLUNTARY swap_rfiles
+#else
+#define SWAP_VOLUNTARY swap_rfiles_fast
+#endif
+
+// The list locks only matter when several workers share the lists.
+#define LIB_LOCK() do { if (mn_mode) pthread_mutex_lock(&lib_lock); } while (0)
+#define LIB_UNLOCK() do { if (mn_mode) pthread_mutex_unlock(&lib_lock); } while (0)
+
+
+// How many scheduling decisions go by between non-blocking checks of the idle
+// hook, so parked threads are woken even while others keep the CPU busy.
+#define LWP_POLL_INTERVAL 64
+
+// One in how many scheduling decisions is timed for lwp_stats_snapshot().
+#define DECIDE_SAMPLE 64
+
+// The signal the preemption timer raises. ITIMER_VIRTUAL only counts time
+// spent running, so a process sleeping in the kernel isn't woken for nothing.
+#define LWP_TICK_SIGNAL SIGVTALRM
+#define LWP_TICK_TIMER ITIMER_VIRTUAL
+
+// Growable stacks (see lwp_set_stack_growth()): the size of the alternate
+// signal stack the fault handler runs on, one per pthread.
+#define LWP_ALTSTACK_SIZE (64 * 1024)
+
+// How many threads tid2thread() can find without searching (a power of two).
+#define TID_CACHE_SIZE 4096
+
+// How many times lwp_exit() goes round the destructors, for ones that set
+// values again.
+#define LWP_KEY_ROUNDS 4
+
+// Stack watching (see lwp_stack_watch()): what watched stacks are painted
+// with.
+#define STACK_PAINT_WORD 0x57ac57ac57ac57acUL
+
+// Tracing (see lwp_trace()). The environment variable names the file to trace
+// into; the signal dumps the ring there on demand. The ring keeps the most
+// recent LWP_TRACE_EVENTS events (a power of two).
+#define LWP_TRACE_ENV "LWP_TRACE"
+#define LWP_TRACE_SIGNAL SIGUSR2
+#define LWP_TRACE_EVENTS (1 << 18)
+#define TRACE(type, t, tsc) \
+  do { if (trace_ring != NULL) trace_log((type), (t), (tsc)); } while (0)
+
+
+// === DATA DEFINITIONS ======================================================
+// What a worker has to do with the thread that just switched back to it.
+// This can't be done by the thread itself, since another worker could pick
+// it up before its registers are saved.
+typedef enum { MN_YIELD, MN_EXIT, MN_WAIT } mn_op;
+
+// What happened to a thread, for the tracer.
+typedef enum {
+  TRACE_CREATE, TRACE_IN, TRACE_OUT, TRACE_PREEMPT, TRACE_BLOCK, TRACE_WAKE,
+  TRACE_EXIT
+} trace_type;
+
+// One slot of the trace ring.
+typedef struct trace_event {
+  unsigned long long tsc;       // when (converted to ns on the way out)
+  tid_t              tid;
+  int                type;      // a trace_type
+  int                worker;    // -1 outside of M:N mode
+} trace_event;
+
+// Where a trace is being dumped.
+typedef struct trace_out {
+  int    fd;
+  size_t len;
+  char   buf[4096];
+} trace_out;
+
+// A worker pthread in M:N mode.
+typedef struct worker {
+  rfile     state;              // the worker's own context
+  pthread_t pthread;
+  int       id;
+  mn_op     op;                 // set by the thread switching back
+} worker;
+
+// Equal-sized slots carved out of slabs (see ctx_slabs). Free slots are
+// linked through their first word.
+typedef struct slab_class {
+  void  *free;
+  size_t count;                 // how many slots are free
+  size_t stride;                // a slot, in whole cache lines
+} slab_class;
+
 
 // === HELPER FUCNTIONS ======================================================
 // Adds a thread to any one of the lists/queues (live, term, blck).
@@ -30,6 +153,92 @@ static void lwp_list_remove(thread *head, thread *tail, thread victim);
 static void lwp_wrap(lwpfun fun, void *arg);
 // Gets the size of the virtual stack each thread will have.
 static size_t get_stacksize(void);
+// Builds a new thread's first stack frame and registers.
+static void lwp_frame(thread new, lwpfun function, void *argument);
+// Gives a new thread its id and puts it on the live list.
+static void lwp_register(thread new);
+// Frees a terminated thread's stack and context.
+static tid_t lwp_reap(thread t, int *status);
+// Frees the detached thread that exited on the stack we just left.
+static void lwp_reap_zombie(void);
+// Hands a terminated thread (or NULL) to the oldest lwp_wait()er.
+static void lwp_unblock(thread exited);
+// Accessors for the per-pthread state. These are never inlined so that the
+// TLS address is looked up again after a thread moves to another worker.
+static thread get_curr(void) __attribute__((noinline));
+static void set_curr(thread t) __attribute__((noinline));
+static worker *get_me(void) __attribute__((noinline));
+// Runs every LWP on n worker pthreads and returns once they have all exited.
+static void lwp_run_workers(int n);
+// The loop each worker pthread runs.
+static void *lwp_worker(void *arg);
+// Finishes a yield, exit or wait on behalf of the thread that just left.
+static void lwp_worker_settle(worker *w, thread t);
+// Admits a thread in M:N mode, waking a parked worker to take it.
+static void mn_admit(thread t);
+// Wakes parked workers (one, or all of them) if there are any.
+static void mn_wake(int all);
+// Enters/leaves a section the preemption timer must not interrupt.
+static void crit_enter(void);
+static void crit_leave(void);
+// Switches from one thread to another, charging the next one a fresh slice.
+static void lwp_switch(thread old, thread next, int full);
+// The preemption timer's signal handler.
+static void lwp_tick(int signum);
+// Gets the next thread to run, waiting in the idle hook if none is runnable.
+static thread lwp_pick(void);
+// Fires due timers, and polls the idle hook every so often.
+static void lwp_poll(void);
+// Asks the scheduler for the next thread, keeping the decision stats.
+static thread lwp_decide(scheduler sched);
+// Reads the clock the accounting runs on (the TSC).
+static unsigned long long acct_now(void);
+// Starts a thread's accounting.
+static void acct_init(thread t);
+// Converts TSC ticks to nanoseconds.
+static unsigned long long acct_ns(unsigned long long ticks);
+// Copies a thread's accounting out.
+static void acct_copy(thread t, lwp_thread_stats *out);
+// Turns tracing on if LWP_TRACE_ENV asks for it (the first time only).
+static void trace_env(void);
+// Puts an event in the trace ring.
+static void trace_log(trace_type type, thread t, unsigned long long tsc);
+// Dumps the trace at exit, or on LWP_TRACE_SIGNAL.
+static void trace_atexit(void);
+static void trace_signal(int signum);
+// Buffered writes for the dump (which may be in a signal handler, so it
+// sticks to write()).
+static void trace_put(trace_out *out, const char *str);
+static void trace_put_num(trace_out *out, unsigned long long n);
+static void trace_flush(trace_out *out);
+// Maps a new thread's stack (all of it, or just the top if it can grow).
+static void *stack_map(size_t size, size_t *commit);
+// Maps n stacks in one go.
+static void *stack_map_many(size_t size, int n, size_t *commit);
+// Paints the top of a new stack, so how deep it goes can be read off later.
+static void stack_paint(thread t);
+// Finds how deep a painted stack has gone.
+static size_t stack_depth(thread t);
+// Folds a reaped thread's depth into its entry function's record.
+static void stack_record(thread t);
+// Gives this pthread an alternate signal stack (once).
+static int stack_altstack(void);
+// Grows the current thread's stack when it touches the unmapped part.
+static void stack_fault(int signum, siginfo_t *info, void *uctx);
+// Runs the exiting thread's key destructors and frees its overflow table.
+static void key_destroy(thread t);
+// Takes a context off the slab free list, mapping a new slab if it's empty.
+static thread ctx_alloc(void);
+// Puts a context back on the free list.
+static void ctx_free(thread t);
+// Sizes the slots of the context slab class.
+static void slab_setup(void);
+// Takes a slot off a slab class's free list (mapping a slab if it's empty).
+static void *slab_alloc(slab_class *c);
+// Puts a slot back on its class's free list.
+static void slab_free(slab_class *c, void *slot);
+// Makes sure a slab class has at least n free slots.
+static int slab_reserve(slab_class *c, size_t n);
 
 
 // === GLOBAL VARIABLES ======================================================
@@ -47,13 +256,108 @@ static thread term_tail = NULL;
 static thread blck_head = NULL;  // Holds blocked threads.
 static thread blck_tail = NULL;
 
-// The thread that is currently in context.
-static thread curr = NULL;
+// The thread that is currently in context (on this pthread).
+static __thread thread curr = NULL;
+
+// A detached thread that has exited, but whose stack was still in use when
+// it did. Whoever runs next frees it.
+static thread zombie = NULL;
 
 // A counter for all the ids. We assume the domain will never be more than
 // 2^64 - 2 threads, so keeping a rolling counter is just fine.
 static tid_t tid_counter = 1;
 
+// Threads by tid % TID_CACHE_SIZE, so tid2thread() (and so lwp_yield_to())
+// doesn't have to search the lists for them. A thread is in its slot from
+// its creation until a newer one takes the slot or it is reaped.
+static thread tid_cache[TID_CACHE_SIZE];
+
+// Threads that haven't terminated yet, and how many of those are blocked in
+// lwp_wait().
+static int live_count = 0;
+static int blck_count = 0;
+
+// M:N state. Zero workers means "not set": fall back on LWP_WORKERS_ENV.
+static int nworkers = 0;
+static int mn_mode = FALSE;
+static worker *workers = NULL;
+static pthread_mutex_t lib_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Workers with nothing to run or steal sleep on mn_idle_cond (under
+// lib_lock) until a thread is admitted or the last one exits. mn_idle counts
+// them, so admitting only takes the lock when somebody is asleep.
+static pthread_cond_t mn_idle_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int mn_idle = 0;
+
+// The worker this pthread is (NULL outside of M:N mode).
+static __thread worker *me = NULL;
+
+// Preemption. crit is how deep we are in library code (or in a section the
+// user masked); a tick that lands inside one is deferred until it ends. The
+// depth is per thread: lwp_switch() keeps it on the stack while we're out.
+static unsigned long quantum_usec = 0;  // 0: cooperative only
+static volatile sig_atomic_t crit = 0;
+static volatile sig_atomic_t preempt_pending = FALSE;
+static volatile sig_atomic_t slice_left = 1;  // ticks left for curr
+
+// Waits for events that unpark threads (see lwp_set_idle()), and how many
+// picks are left before it is polled again.
+static int (*idle_hook)(long long timeout_ns) = NULL;
+static int poll_countdown = LWP_POLL_INTERVAL;
+
+// Scheduler-wide stats (single worker only), in TSC ticks. tsc_base and
+// ns_base are read together when the first thread starts, and how far each
+// has moved since gives the TSC's rate.
+static unsigned long decisions = 0;
+static unsigned long long decide_ticks = 0;
+static unsigned long long decide_max = 0;
+static long long qlen_sum = 0;
+static int qlen_max = 0;
+static unsigned long long idle_ticks = 0;
+static unsigned long long tsc_base = 0;
+static long long ns_base = 0;
+
+// When the last decision was made. Every switch follows one, so the switch
+// charges up to then rather than reading the TSC again.
+static unsigned long long decided_at = 0;
+
+// Growable stacks. stack_initial is how much of a new stack is mapped in (0:
+// all of it, as usual). The fault handler runs on the alternate stack, since
+// the one that faulted has no room.
+static size_t stack_initial = 0;
+static size_t page_bytes = 0;
+static __thread void *altstack = NULL;
+
+// Stack watching. stack_watch is how much of each new stack to paint (0:
+// off). Reaped threads' depths are kept per entry function, in a list that is
+// short (there are only so many functions) and is never freed.
+typedef struct stack_usage {
+  lwp_stack_usage     usage;
+  struct stack_usage *next;
+} stack_usage;
+static size_t stack_watch = 0;
+static stack_usage *stack_usages = NULL;
+static pthread_mutex_t stack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Slabs: contexts live in the slots of a slab class. The slots of a slab are
+// handed out in address order, so threads created together sit together.
+// Slabs are never unmapped.
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static slab_class ctx_slabs = { NULL, 0, 0 };
+
+// Thread-specific data keys: how many have been made, and their destructors.
+// Keys are never deleted, so a key's slot means the same thing for good.
+static unsigned int key_count = 0;
+static void (*key_dtors[LWP_KEYS_MAX])(void *);
+
+// The trace ring (NULL while tracing is off), and how many events have ever
+// been put in it: event i lives in slot i % LWP_TRACE_EVENTS. Workers claim
+// slots with an atomic add, so logging never takes a lock.
+static trace_event *trace_ring = NULL;
+static unsigned long trace_head = 0;
+static char *trace_path = NULL;
+static int trace_checked = FALSE;
+
 
 // === LWP FUCNTIONS =========================================================
 // Creates a new lightweight process which executes the given function
@@ -63,11 +367,17 @@ static tid_t tid_counter = 1;
 // @return A tid_t thread id of the process that we have just created. (Or
 // NO_THREAD if a thead could not be created).
 tid_t lwp_create(lwpfun function, void *argument){
+  // Don't get preempted while holding the free list.
+  crit_enter();
+  trace_env();
+
   // "Create" a new thread by saving the context of a thread somewhere in
-  // memory. If the syscall fails, catch it and bail; something has gone wrong.
-  thread new = malloc(sizeof(context));
+  // memory (a slot of a context slab). If the syscall fails, catch it and
+  // bail; something has gone wrong.
+  thread new = ctx_alloc();
   if (new == NULL) {
-    perror("[lwp_create] Error when getting malloc()ing a new thread.");
+    perror("[lwp_create] Error when getting a context for a new thread.");
+    crit_leave();
     return NO_THREAD;
   }
 
@@ -76,108 +386,195 @@ tid_t lwp_create(lwpfun function, void *argument){
   size_t new_stacksize = get_stacksize();
   if (new_stacksize == 0) {
     perror("[lwp_create] Error when getting RLIMIT_STACK.");
-    free(new);
+    ctx_free(new);
+    crit_leave();
     return NO_THREAD;
   }
   new->stacksize = new_stacksize;
 
   // mmap() a new chunk of memory for this thread. This acts as the virtual 
   // stack this thread can have. Give it read and write permissions (not
-  // execute). The offset should also be zero.
-  void *new_stack = mmap(
-      NULL, 
-      new_stacksize, 
-      PROT_READ|PROT_WRITE, 
-      MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, 
-      -1, 
-      0);
+  // execute), or, for a growable stack, just the top of it.
+  void *new_stack = stack_map(new_stacksize, &new->stackcommit);
 
   // If the syscall fails, catch it and bail; something has gone wrong.
   if (new_stack == MAP_FAILED) {
     perror("[lwp_create] Error when mmapp()ing a new stack.");
-    free(new);
+    ctx_free(new);
+    crit_leave();
     return NO_THREAD;
   }
   // Update the new thread's context with this pointer to the "lowest" point
   // in memory of the stack. Arithmetic is done later.
   new->stack = new_stack;
+  new->entry = function;
+  new->gen = NULL;
+  stack_paint(new);
 
-  // ========================================================================
-  // Virual Stack Creation
-  // This is where a lot of the magic happens. This allows for the this to be
-  // "returned to", allowing for the instruction pointer to go to the function
-  // we really want to be executed, with the correct arguments.
-
-  // This is the reall "bottom" of the virtual stack. It is the highest address
-  // in our mmap()ed space, and it will grow towards the lower addresses.
-  uintptr_t *stack = (uintptr_t*)(new_stack + new_stacksize);
+  // Build the frame it starts from.
+  lwp_frame(new, function, argument);
 
-  // Offset the address we will put lwp_wrap to a multuple of the
-  // BYTE_STACK_ALIGNMENT. All stack frames must be built on that boundary.
-  stack = stack - (uintptr_t)(BYTE_STACK_ALIGNMENT);
+  // Give it an id and put it on the live list.
+  LIB_LOCK();
+  lwp_register(new);
+  LIB_UNLOCK();
 
-  // Fill in the return address (lwp_wrap); where we will go.
-  *stack = (uintptr_t)lwp_wrap;
+  // Admit the newly created thread to the current scheduler.
+  scheduler sched = lwp_get_scheduler();
+  sched->admit(new);
+  new->runnable = TRUE;
+  if (mn_mode) {
+    mn_wake(FALSE);
+  }
 
-  // Make room for the base pointer. (Contents don't matter).
-  stack--;
+  tid_t id = new->tid;
+  crit_leave();
+  return id;
+}
 
-  // Filling in the Registers
-  // Stack now points to where the base pointer will be.
-  new->state.rbp = (unsigned long)stack;
+// Creates n lightweight processes at once, the i-th executing
+// function(args[i]) (or function(NULL) if args is NULL). It is lwp_create()
+// in bulk: the stack size is looked up once, the stacks are carved out of a
+// few big mappings (and freed one by one as the threads are reaped), the
+// contexts come off the slab in one go,
+// and the threads are registered and admitted in one pass. They are admitted
+// in order, so a FIFO scheduler runs them in order too.
+// @param function The lwpfun they will execute.
+// @param args Their arguments (or NULL).
+// @param n How many to create.
+// @param tids Where to put their ids (or NULL).
+// @return n, or -1 if none could be created.
+int lwp_create_many(lwpfun function, void **args, int n, tid_t *tids) {
+  int i;
+
+  if (n <= 0) {
+    return 0;
+  }
 
-  // Rsp doesn't matter... we will just point it to the same spot.
-  // This will return to the stackframe we just set to lwp_wait.
-  new->state.rsp = (unsigned long)stack;
+  crit_enter();
+  trace_env();
 
-  // First argument (lwpfun) - the function
-  new->state.rdi = (unsigned long)function;
+  size_t stacksize = get_stacksize();
+  if (stacksize == 0) {
+    perror("[lwp_create_many] Error when getting RLIMIT_STACK.");
+    crit_leave();
+    return -1;
+  }
 
-  // Second argument (void*) - the argument
-  new->state.rsi = (unsigned long)argument;
+  // All the contexts, from as few slabs as possible.
+  thread *made = malloc((size_t)n * sizeof(thread));
+  if (made == NULL) {
+    perror("[lwp_create_many] Error when malloc()ing the thread table.");
+    crit_leave();
+    return -1;
+  }
 
-  // Floating point registers
-  new->state.fxsave = FPU_INIT;
+  LIB_LOCK();
+  if (slab_reserve(&ctx_slabs, n) == -1) {
+    LIB_UNLOCK();
+    perror("[lwp_create_many] Error when mmap()ing a context slab.");
+    free(made);
+    crit_leave();
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    made[i] = slab_alloc(&ctx_slabs);
+  }
+  LIB_UNLOCK();
+
+  // The stacks, a batch at a time: one mapping for all of them could be
+  // turned down by the kernel's overcommit check where the same stacks
+  // mapped one by one wouldn't be.
+  size_t per = STACK_BATCH_BYTES / stacksize;
+  if (per == 0) {
+    per = 1;
+  }
 
-  // ========================================================================
+  size_t commit = 0;
+  int k;
+  for (i = 0; i < n; i += k) {
+    k = ((size_t)(n - i) < per) ? n - i : (int)per;
+
+    char *map = stack_map_many(stacksize, k, &commit);
+    if (map == MAP_FAILED) {
+      perror("[lwp_create_many] Error when mmapp()ing the stacks.");
+
+      // Give back everything this call took.
+      int j;
+      for (j = 0; j < i; j++) {
+        munmap(made[j]->stack, stacksize);
+      }
+      for (j = 0; j < n; j++) {
+        ctx_free(made[j]);
+      }
+      free(made);
+      crit_leave();
+      return -1;
+    }
 
-  // Create a new id (just incrementing a counter).
-  new->tid = tid_counter;
-  tid_counter++; 
+    int j;
+    for (j = 0; j < k; j++) {
+      made[i + j]->stack = (unsigned long *)(map + (size_t)j * stacksize);
+    }
+  }
 
-  // Indicate that it is a live and running process.
-  new->status = LWP_LIVE;
+  for (i = 0; i < n; i++) {
+    thread new = made[i];
+    new->stacksize = stacksize;
+    new->stackcommit = commit;
+    new->entry = function;
+    new->gen = NULL;
+    stack_paint(new);
+    lwp_frame(new, function, (args != NULL) ? args[i] : NULL);
+  }
 
-  // For sanity these are all set to NULL. This is a habbit I picked up for 
-  // debugging.
-  new->lib_one = NULL;
-  new->lib_two = NULL;
-  new->sched_one = NULL;
-  new->sched_two = NULL;
-  new->exited = NULL;
-  
-  // Add this to the global list of live threads. The order doesn't matter: I 
-  // put them on the back of the list.
-  lwp_list_enqueue(&live_head, &live_tail, new);
+  LIB_LOCK();
+  for (i = 0; i < n; i++) {
+    lwp_register(made[i]);
+  }
+  LIB_UNLOCK();
 
-  // Admit the newly created thread to the current scheduler.
   scheduler sched = lwp_get_scheduler();
-  sched->admit(new);
+  for (i = 0; i < n; i++) {
+    sched->admit(made[i]);
+    made[i]->runnable = TRUE;
+    if (tids != NULL) {
+      tids[i] = made[i]->tid;
+    }
+  }
+  if (mn_mode) {
+    mn_wake(TRUE);
+  }
 
-  return new->tid;
+  free(made);
+  crit_leave();
+  return n;
 }
 
 // Starts the LWP system. Converts the calling thread (the original system
 // thread) into a LWP and lwp yield()s to whichever thread the scheduler 
-// chooses.
+// chooses. If more than one worker was asked for (lwp_set_workers() or the
+// LWP_WORKERS environment variable), the threads are run by that many
+// pthreads instead, and this returns once every one of them has exited.
 // @param void.
 // @return void.
 void lwp_start(void){
+  trace_env();
+
+  int n = nworkers;
+  if (n == 0 && getenv(LWP_WORKERS_ENV) != NULL) {
+    n = atoi(getenv(LWP_WORKERS_ENV));
+  }
+  if (n > 1) {
+    lwp_run_workers(n);
+    return;
+  }
+
   // "Create" a new thread by saving the context of a thread somewhere in
   // memory. If the syscall fails, catch it and bail; something has gone wrong.
-  thread new = malloc(sizeof(context));
+  thread new = ctx_alloc();
   if (new == NULL) {
-    perror("[lwp_start] Error when malloc()ing a the original thread.");
+    perror("[lwp_start] Error when getting a context for the original thread.");
     exit(EXIT_FAILURE);
   }
 
@@ -185,6 +582,10 @@ void lwp_start(void){
   // create a new stack.
   new->stack = NULL; 
   new->stacksize = 0;
+  new->stackcommit = 0;
+  new->stackpaint = 0;
+  new->entry = NULL;
+  new->gen = NULL;
   
   // Create a new id (just using a counter).
   new->tid = tid_counter;
@@ -199,44 +600,148 @@ void lwp_start(void){
   new->sched_one = NULL;
   new->sched_two = NULL;
   new->exited = NULL;
+  new->wait_next = NULL;
+  new->joiner = NULL;
+  new->detached = FALSE;
+  memset(new->sched_data, 0, sizeof(new->sched_data));
+  new->tickets = 0;
+  memset(new->specific, 0, sizeof(new->specific));
+  new->specific_more = NULL;
+  acct_init(new);
+  TRACE(TRACE_CREATE, new, acct_now());
 
   // Set the current thread to be the one we just created.
-  curr = new;
+  set_curr(new);
+  TRACE(TRACE_IN, new, acct_now());
   
   // Add this to the rolling global list of items.
   lwp_list_enqueue(&live_head, &live_tail, new);
+  live_count++;
+  tid_cache[new->tid & (TID_CACHE_SIZE - 1)] = new;
 
   // Admit the newly created "main" thread to the current scheduler.
   scheduler sched = lwp_get_scheduler();
   sched ->admit(new);
+  new->runnable = TRUE;
 
   // Start the yielding process.
   lwp_yield();
 }
 
+// Turns on preemption: every usec microseconds of CPU time the running
+// thread's slice is charged one tick, and a thread whose slice runs out is
+// switched away from as if it had called lwp_yield(). A slice is one tick
+// unless the scheduler's quantum() hint says otherwise. Zero turns
+// preemption back off. Only the single-worker runtime is preempted.
+// @param usec The length of a tick in microseconds (or 0).
+// @return void.
+void lwp_set_quantum(unsigned long usec) {
+  // Install the handler the first time preemption is turned on.
+  if (usec != 0 && quantum_usec == 0) {
+    struct sigaction sa;
+    sa.sa_handler = lwp_tick;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+
+    if (sigaction(LWP_TICK_SIGNAL, &sa, NULL) == -1) {
+      perror("[lwp_set_quantum] Error when installing the tick handler.");
+      return;
+    }
+  }
+
+  // A zeroed timer disarms it.
+  struct itimerval it;
+  it.it_interval.tv_sec = usec / 1000000;
+  it.it_interval.tv_usec = usec % 1000000;
+  it.it_value = it.it_interval;
+
+  if (setitimer(LWP_TICK_TIMER, &it, NULL) == -1) {
+    perror("[lwp_set_quantum] Error when arming the tick timer.");
+    return;
+  }
+
+  quantum_usec = usec;
+}
+
+// Masks preemption until the matching lwp_preempt_enable(). Calls nest. Use
+// it around code that takes locks no other LWP may wait on, e.g. stdio.
+// @param void.
+// @return void.
+void lwp_preempt_disable(void) {
+  crit_enter();
+}
+
+// Unmasks preemption. If a tick was deferred, yields now.
+// @param void.
+// @return void.
+void lwp_preempt_enable(void) {
+  crit_leave();
+}
+
 // Yields control to another LWP. Which one depends on the scheduler.
 // Saves the current LWP's context, picks the next one, restores that thread's
 // context, and returns. If there is no next thread, it terminates the program.
+// In M:N mode the thread switches back to its worker, which requeues it.
 // @param void.
 // @return void.
 void lwp_yield(void) {
+  thread old = get_curr();
+
+  if (mn_mode) {
+    worker *w = get_me();
+    w->op = MN_YIELD;
+    SWAP_VOLUNTARY(&old->state, &w->state);
+    return;
+  }
+
+  crit_enter();
+
   // Get the thread that the scheduler gives next.
-  scheduler sched = lwp_get_scheduler();
-  thread next = sched->next();
+  thread next = lwp_pick();
 
   // The scheduler has nothing more to give.
   if (next == NULL) {
-    unsigned int s = curr->status;
-    free(curr);
+    unsigned int s = old->status;
+    ctx_free(old);
     exit(s);
   }
 
-  // The current thread is now the new thread the scheduler just chose.
-  thread old = curr;
-  curr = next;
- 
-  // Switch contexts.
-  swap_rfiles(&old->state, &next->state);
+  // Switch contexts. The current thread is now the new thread the scheduler
+  // just chose.
+  lwp_switch(old, next, FALSE);
+
+  crit_leave();
+}
+
+// Yields straight to a particular thread, without asking the scheduler's
+// next(), so a thread that has just made work for another can hand it the
+// CPU at once. The scheduler's picked() (if it has one) is told, so it can
+// charge and rotate as if it had chosen the thread itself. If the thread
+// isn't runnable (or is the caller, or we are in M:N mode) this is just
+// lwp_yield().
+// @param tid The thread to run.
+// @return void.
+void lwp_yield_to(tid_t tid) {
+  thread old = get_curr();
+  thread next = mn_mode ? NULL : tid2thread(tid);
+
+  crit_enter();
+  if (next == NULL || next == old || !next->runnable) {
+    crit_leave();
+    lwp_yield();
+    return;
+  }
+
+  lwp_poll();
+
+  scheduler sched = lwp_get_scheduler();
+  if (sched->picked != NULL) {
+    sched->picked(next);
+  }
+  decided_at = acct_now();
+
+  lwp_switch(old, next, FALSE);
+  crit_leave();
 }
 
 // Terminates the current LWP and yields to whichever thread the scheduler 
@@ -244,37 +749,63 @@ void lwp_yield(void) {
 // @param exitval An int indicating the exit value.
 // @return void.
 void lwp_exit(int exitval) {
-  // Remove from the scheduler.
-  scheduler sched = lwp_get_scheduler();
-  sched->remove(curr);
+  thread self = get_curr();
 
-  // Combine the status and the exitval, and set it as the thread's new status.
-  curr->status = MKTERMSTAT(curr->status, exitval);
+  // Not an LWP (the original thread after an M:N lwp_start()); just leave.
+  if (self == NULL) {
+    exit(exitval);
+  }
 
-  // Take the thread off the live list, and add the current thread to the queue
-  // of terminated threads.
-  lwp_list_remove(&live_head, &live_tail, curr);
-  lwp_list_enqueue(&term_head, &term_tail, curr);
- 
-  // Do some blocking checks if there are blocked threads.
-  if (blck_head != NULL) {
-    // Get the oldest blocked thread that is waiting for a process to end.
-    thread unblocked = blck_head;
+  // Destructors are user code, and may do anything an LWP may.
+  key_destroy(self);
 
-    // Remove it from the blocked queue.
-    lwp_list_remove(&blck_head, &blck_tail, unblocked);
+  // Never returns, so this is never left.
+  crit_enter();
 
-    // Set the blocked .exited status to this current thread.
-    unblocked->exited = curr;
+  // Mark the thread terminated and fold in the exitval. (LWPTERMINATED() is
+  // how lwp_join() tells an exited thread from a live one.)
+  self->status = MKTERMSTAT(LWP_TERM, exitval);
+  TRACE(TRACE_EXIT, self, acct_now());
 
-    unblocked->sched_one = NULL;
-    unblocked->sched_two = NULL;
+  // The worker does the bookkeeping once we are off this stack.
+  if (mn_mode) {
+    worker *w = get_me();
+    w->op = MN_EXIT;
+    SWAP_VOLUNTARY(&self->state, &w->state);
+  }
 
-    // Add the unblocked thread to the scheduler again.
-    sched->admit(unblocked);
+  // Remove from the scheduler.
+  scheduler sched = lwp_get_scheduler();
+  sched->remove(self);
+  self->runnable = FALSE;
 
-    // Add it back to the live pool.
-    lwp_list_enqueue(&live_head, &live_tail, unblocked);
+  // Take the thread off the live list.
+  lwp_list_remove(&live_head, &live_tail, self);
+  live_count--;
+ 
+  if (self->joiner != NULL) {
+    // Somebody is joining this thread in particular; it gets it directly.
+    lwp_unpark(self->joiner);
+  }
+  else if (self->detached) {
+    // Nobody wants it. We are still on its stack, so the next thread to run
+    // frees it.
+    zombie = self;
+
+    // If everybody left is in lwp_wait(), nothing can ever exit for them.
+    // Let one of them find that out.
+    if (blck_head != NULL && live_count == blck_count) {
+      lwp_unblock(NULL);
+    }
+  }
+  else if (blck_head != NULL) {
+    // Hand this thread straight to the oldest waiter. It never goes on the
+    // terminated queue, so no other lwp_wait() can reap it first.
+    lwp_unblock(self);
+  }
+  else {
+    // Nobody is waiting; add it to the queue of terminated threads.
+    lwp_list_enqueue(&term_head, &term_tail, self);
   }
 
   lwp_yield();
@@ -284,10 +815,11 @@ void lwp_exit(int exitval) {
 // @param void.
 // @return The tid_t of the calling (current) lwp.
 tid_t lwp_gettid(void) {
-  if (curr == NULL) {
+  thread self = get_curr();
+  if (self == NULL) {
     return NO_THREAD;
   }
-  return curr->tid;
+  return self->tid;
 }
 
 // Returns the thread corresponding to the given thread ID, or NULL if the ID
@@ -295,10 +827,23 @@ tid_t lwp_gettid(void) {
 // @param tid The tid_t we are searching for.
 // @return The thread whos tid matches the parameter (or NULL if not found).
 thread tid2thread(tid_t tid) {
+  crit_enter();
+  LIB_LOCK();
+
+  // Most of the time it is still in its slot.
+  thread t = tid_cache[tid & (TID_CACHE_SIZE - 1)];
+  if (t != NULL && t->tid == tid) {
+    LIB_UNLOCK();
+    crit_leave();
+    return t;
+  }
+
   // Linear search through all live threads.
-  thread t = live_head;
+  t = live_head;
   while (t != NULL) {
     if (t->tid == tid) {
+      LIB_UNLOCK();
+      crit_leave();
       return t;
     }
     t = t->NEXT;
@@ -308,6 +853,8 @@ thread tid2thread(tid_t tid) {
   t = term_head;
   while (t != NULL) {
     if (t->tid == tid) {
+      LIB_UNLOCK();
+      crit_leave();
       return t;
     }
     t = t->NEXT;
@@ -317,12 +864,16 @@ thread tid2thread(tid_t tid) {
   t = blck_head;
   while (t != NULL) {
     if (t->tid == tid) {
+      LIB_UNLOCK();
+      crit_leave();
       return t;
     }
     t = t->NEXT;
   }
 
   // If we have reached this point, then there is no id that matches
+  LIB_UNLOCK();
+  crit_leave();
   return NULL;
 }
 
@@ -333,67 +884,158 @@ thread tid2thread(tid_t tid) {
 // thread. 
 // @return The tid of the thread who was waited upon.
 tid_t lwp_wait(int *status) {
+  thread self = get_curr();
+  crit_enter();
+
   // Grab the first element of the terminated queue.
+  LIB_LOCK();
   thread t = term_head;
 
-  // If there are no termiated to be cleaned, either block, or return NO_THREAD
-  if (t == NULL) {
-    // If there are no more threads that could possibly block (if the scheduler
-    // has 1 element in it).
+  if (t != NULL) {
+    lwp_list_remove(&term_head, &term_tail, t);
+    t->joiner = self;
+    LIB_UNLOCK();
+  }
+  else {
+    // If there are no termiated to be cleaned, either block, or return
+    // NO_THREAD if there are no more threads that could possibly exit
+    // (everybody else is waiting too). Parked threads count here, since they
+    // may run again; if none of them ever does, lwp_pick() lets us go.
     scheduler sched = lwp_get_scheduler();
+    int stuck = (live_count - blck_count <= 1);
+    LIB_UNLOCK();
 
-    if (sched->qlen() <= 1) {
+    if (stuck) {
+      crit_leave();
       return NO_THREAD;
     }
 
     // We must be blocked... How sad.
-    // Deschedule the current thread.
-    sched->remove(curr);
-
-    // Remove the curr thread from the live list, and put it on the blocked
-    // queue.
-    lwp_list_remove(&live_head, &live_tail, curr);
-    lwp_list_enqueue(&blck_head, &blck_tail, curr);
-
-    // Yield to another process.
-    lwp_yield();
+    TRACE(TRACE_BLOCK, self, acct_now());
+    if (mn_mode) {
+      // Our worker puts us on the blocked queue, or hands us a thread that
+      // exited in the meantime.
+      worker *w = get_me();
+      w->op = MN_WAIT;
+      SWAP_VOLUNTARY(&self->state, &w->state);
+    }
+    else {
+      // Deschedule the current thread.
+      sched->remove(self);
+      self->runnable = FALSE;
+
+      // Remove the curr thread from the live list, and put it on the blocked
+      // queue.
+      lwp_list_remove(&live_head, &live_tail, self);
+      lwp_list_enqueue(&blck_head, &blck_tail, self);
+      blck_count++;
+
+      // Yield to another process.
+      lwp_yield();
+    }
     
     // At this point, we have returned!
-    // NOTE: curr->exited has been populated with the exited thread
-
-    // .exited is now the next thread to deallocate (t)
-    t = curr->exited;
+    // NOTE: self->exited has been populated with the exited thread, which
+    // was handed to us directly and isn't on the terminated queue. It is
+    // NULL if the last threads that could have exited were detached.
+    t = self->exited;
+    if (t == NULL) {
+      crit_leave();
+      return NO_THREAD;
+    }
   }
 
-  // Remove the thread from wherever it is
-  // 1) it is either the head of the terminated queue
-  // 2) it is somewhere in the (beginning, middle or end) of the terminated 
-  // queue (but it is chosen as the next thread to remove as it is from a 
-  // blocked process.
-  lwp_list_remove(&term_head, &term_tail, t);
+  tid_t id = lwp_reap(t, status);
 
-  if (munmap(t->stack, t->stacksize) == -1) {
-    // Something terribly wrong has happened. This syscall failed, so we
-    // note the error and give up. In prod, we might try to limp along, but
-    // for now, we are just bailing. 
-    perror("[lwp_wait] Error munmapping lwp! Bailing now...");
-    exit(EXIT_FAILURE);
+  crit_leave();
+  return id;
+}
+
+// Waits for one particular thread to terminate, deallocates its resources,
+// and reports its termination status if status is non-NULL. The waiter is
+// parked on the thread itself, so the exit wakes it directly. Only one thread
+// may join a given thread, and a detached one can't be joined. Single worker
+// only.
+// @param tid The thread to wait for.
+// @param status A pointer to an integer (or NULL) that holds the status of
+// the thread.
+// @return tid, or NO_THREAD if it can't be joined.
+tid_t lwp_join(tid_t tid, int *status) {
+  thread self = get_curr();
+  if (mn_mode || self == NULL) {
+    return NO_THREAD;
   }
 
-  // The parameter status can be null. Don't try to dereference a NULL pointer.
-  if (status != NULL) {
-    *status = t->status;
+  // Look it up and check it with ticks masked: otherwise another thread
+  // could reap it (and its context be reused) in between. A thread with a
+  // joiner is taken, whether by another lwp_join() or by the lwp_wait() its
+  // exit was handed to.
+  crit_enter();
+  thread t = tid2thread(tid);
+  if (t == NULL || t == self || t->detached || t->joiner != NULL) {
+    crit_leave();
+    return NO_THREAD;
   }
 
-  // Save the id because we are going to free the thread soon.
-  tid_t id = t->tid;
+  if (LWPTERMINATED(t->status)) {
+    // It exited before anybody asked; it is on the terminated queue.
+    lwp_list_remove(&term_head, &term_tail, t);
+  }
+  else {
+    // lwp_exit() unparks us, and leaves the thread off every list.
+    t->joiner = self;
+    lwp_park();
+  }
 
-  // Free the memory malloced for the thread's context.
-  free(t);
+  tid_t id = lwp_reap(t, status);
 
+  crit_leave();
   return id;
 }
 
+// Detaches a thread: nobody will wait for it, so its stack and context are
+// freed as soon as it exits (or right away, if it already has).
+// @param tid The thread.
+// @return 0, or -1 if there is no such thread or it is already detached.
+int lwp_detach(tid_t tid) {
+  // As in lwp_join(), nobody may reap it between the lookup and the checks.
+  crit_enter();
+  thread t = tid2thread(tid);
+  if (t == NULL) {
+    crit_leave();
+    return -1;
+  }
+
+  LIB_LOCK();
+
+  // Somebody is joining it, or lwp_wait() has already claimed it.
+  if (t->detached || t->joiner != NULL) {
+    LIB_UNLOCK();
+    crit_leave();
+    return -1;
+  }
+
+  // The exit is only finished once it is on the terminated queue (a worker
+  // may still be putting it there).
+  thread u = term_head;
+  while (u != NULL && u != t) {
+    u = u->NEXT;
+  }
+
+  if (u != NULL) {
+    lwp_list_remove(&term_head, &term_tail, t);
+    LIB_UNLOCK();
+    lwp_reap(t, NULL);
+  }
+  else {
+    t->detached = TRUE;
+    LIB_UNLOCK();
+  }
+
+  crit_leave();
+  return 0;
+}
+
 // Causes the LWP package to use the given scheduler to choose the next process
 // to run. Transfers all threads from the old scheduler to the new one in 
 // next() order. If scheduler is NULL, this defaults to the MyRoundRobin 
@@ -412,6 +1054,14 @@ void lwp_set_scheduler(scheduler sched) {
     return;
   }
 
+  // The workers are all pulling from WorkStealing; it can't be swapped out
+  // from under them.
+  if (mn_mode) {
+    return;
+  }
+
+  crit_enter();
+
   // Init the scheduler before any theads are admit()ed
   if (sched->init != NULL) {
     sched->init();
@@ -444,6 +1094,8 @@ void lwp_set_scheduler(scheduler sched) {
   
   // Set the currently used scheduler to the scheduler that we just created
   curr_sched = sched;
+
+  crit_leave();
 }
 
 // Returns the pointer to the current scheduler. If there is none, it defaults
@@ -459,73 +1111,1476 @@ scheduler lwp_get_scheduler(void) {
 }
 
 
-// === QUEUE HELPER FUNCTIONS ================================================
-// Append the new thread to the end of a given list.
-// For the termiated queue and blocked queue this function abides by the FIFO 
-// requirements. As for the list of all running threads, the order in which 
-// threads are added does not matter.
-// WARNING: Make sure head and tail represent the same list. If not, bad things
-// are going to happen...
-// @param head A pointer to the global head of the list.
-// @param tail A pointer to the global tail of the list.
-// @param new The new thread to be added.
+// Sets how many worker pthreads lwp_start() should run the LWPs on. One (the
+// default) keeps everything on the calling thread.
+// @param n The number of workers.
 // @return void.
-static void lwp_list_enqueue(thread *head, thread *tail, thread new) {
-  if (new == NULL) {
-    // This should never happen. Please always call this with a valid 
-    // non-NULL thead.
-    perror("[lwp_list_enqueue] thread new cannot be NULL");
-    exit(EXIT_FAILURE);
+void lwp_set_workers(int n) {
+  nworkers = (n < 1) ? 1 : n;
+}
+
+
+// Makes sure at least n contexts are free, so the next n
+// lwp_create()s don't have to map a slab partway through. Whatever is
+// missing is mapped as one slab, so those threads' contexts are contiguous.
+// @param n How many contexts to have ready.
+// @return 0, or -1 if the slab couldn't be mapped.
+int lwp_reserve(size_t n) {
+  int ret = 0;
+
+  crit_enter();
+  LIB_LOCK();
+  if (slab_reserve(&ctx_slabs, n) == -1) {
+    perror("[lwp_reserve] Error when mmap()ing a context slab.");
+    ret = -1;
   }
+  LIB_UNLOCK();
+  crit_leave();
 
-  if ((*head == NULL) ^ (*tail == NULL)) {
-    // This should never happen. Either they are both NULL, or both something.
-    // If this occurs, then someone has made a big mistake. 
-    perror("[lwp_list_enqueue] mismatching tail and head pointers");
-    exit(EXIT_FAILURE);
+  return ret;
+}
+
+// Makes the stacks of threads created from now on growable: the whole
+// RLIMIT_STACK-sized range is still reserved (it is the cap), but only the
+// top initial bytes of it are mapped in. Touching the rest faults, and the
+// fault handler (on an alternate signal stack) maps in more, at least doubling
+// what the thread has, until the cap. The lowest page is never mapped, so
+// overflowing the cap is a plain segfault instead of a write into whatever
+// is below. Mostly this saves commit charge (and gets the guard page): pages
+// that are never touched aren't resident either way. Each growable stack
+// takes two mappings, so vm.max_map_count limits how many there can be.
+// @param initial How much of each stack to map in up front (rounded up to
+// pages), or 0 to map stacks whole again.
+// @return 0, or -1 if the fault handler can't be set up.
+int lwp_set_stack_growth(size_t initial) {
+  if (initial == 0) {
+    stack_initial = 0;
+    return 0;
   }
-  
-  // There is nothing in the list, so add it and set the head/tail to the same
-  // thread, updating their next and prev pointers.
-  if (*head == NULL && *tail == NULL) {
-    new->NEXT = NULL;
-    new->PREV = NULL;
 
-    *head = new;
-    *tail = new;
-    return;
+  if (page_bytes == 0) {
+    page_bytes = sysconf(_SC_PAGE_SIZE);
   }
 
-  // Otherwise, enqueue to the back of the line (at the tail) as normal.
-  new->NEXT = NULL;
-  new->PREV = *tail;
-  
-  // Set the tail's next value to point to the new thread.
-  (*tail)->NEXT = new;
-  
-  // Set the value at this address to new.
-  *tail = new;
+  if (stack_altstack() == -1) {
+    return -1;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = stack_fault;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  if (sigaction(SIGSEGV, &sa, NULL) == -1) {
+    perror("[lwp_set_stack_growth] Error when installing the fault handler.");
+    return -1;
+  }
+
+  stack_initial = (initial + page_bytes - 1) / page_bytes * page_bytes;
+  return 0;
 }
 
-// Remove a thread from either the queue of termiated threads, the queue of 
-// blocked threads, or the doubly linked list of live threads. 
-// To dequeue properly, call lwp_list_remove(head, tail, head)
-// @param head A pointer to the global head of the list.
-// @param tail A pointer to the global tail of the list.
-// @param new The new thread to be added.
+// Watches how deep the stacks of threads created from now on go: the top
+// paint bytes of each are filled with a pattern, and when the thread is
+// reaped (or lwp_stack_used() asks) the lowest word that no longer holds it
+// is as deep as the thread has been. Reaped threads are added up by entry
+// function for lwp_stack_report(), to size RLIMIT_STACK by. Painting touches
+// those pages, so they stay resident: paint no more than needed.
+// @param paint How much of each stack to paint (rounded down to words, and
+// capped at what is mapped in), or 0 to stop.
 // @return void.
-static void lwp_list_remove(thread *head, thread *tail, thread victim) {
-  if (victim == NULL) {
-    // This should never happen. Please always call this with a valid 
-    // non-NULL thead.
-    perror("[lwp_list_remove] thread victim cannot be NULL");
+void lwp_stack_watch(size_t paint) {
+  stack_watch = paint;
+}
+
+// Says how deep a watched thread's stack has gone so far.
+// @param tid The thread.
+// @return The depth in bytes, or -1 if there is no such thread or its stack
+// isn't painted.
+long lwp_stack_used(tid_t tid) {
+  thread t = tid2thread(tid);
+  if (t == NULL || t->stackpaint == 0) {
+    return -1;
+  }
+  return (long)stack_depth(t);
+}
+
+// Copies out the stack depths of reaped threads, one record per entry
+// function, in no particular order.
+// @param out Where to put them.
+// @param max How many fit there.
+// @return How many entry functions there are (which may be more than max).
+int lwp_stack_report(lwp_stack_usage *out, int max) {
+  pthread_mutex_lock(&stack_lock);
+
+  int n = 0;
+  stack_usage *u;
+  for (u = stack_usages; u != NULL; u = u->next) {
+    if (out != NULL && n < max) {
+      out[n] = u->usage;
+    }
+    n++;
+  }
+
+  pthread_mutex_unlock(&stack_lock);
+  return n;
+}
+
+
+// Returns the calling thread (or NULL if it isn't an LWP).
+// @param void.
+// @return The current thread.
+thread lwp_self(void) {
+  return get_curr();
+}
+
+// Takes the calling thread out of the scheduler and runs somebody else until
+// lwp_unpark() lets it back in. The caller must have put itself somewhere an
+// unparker will find it first (with preemption masked, if it is on). If
+// nothing is runnable, the idle hook is waited on; if there isn't one, every
+// thread is stuck and the process exits. Single worker only: in M:N mode
+// this would switch LWP to LWP behind the workers' backs, so it bails.
+// @param void.
+// @return void.
+void lwp_park(void) {
+  thread self = get_curr();
+
+  if (mn_mode) {
+    fprintf(stderr, "[lwp_park] Can't park with more than one worker. "
+            "Bailing now...\n");
     exit(EXIT_FAILURE);
   }
 
-  if ((*head == NULL) ^ (*tail == NULL)) {
-    // This should never happen. Either they are both NULL, or both something.
-    // If this occurs, then someone has made a big mistake.
-    perror("[lwp_list_dequeue] mismatching tail and head pointers");
+  crit_enter();
+  TRACE(TRACE_BLOCK, self, acct_now());
+  lwp_get_scheduler()->remove(self);
+  self->runnable = FALSE;
+
+  thread next = lwp_pick();
+  if (next == NULL) {
+    fprintf(stderr, "[lwp_park] Every thread is parked. Bailing now...\n");
+    exit(EXIT_FAILURE);
+  }
+
+  lwp_switch(self, next, FALSE);
+  crit_leave();
+}
+
+// Makes a parked thread runnable again. Single worker only, like
+// lwp_park().
+// @param t The thread to unpark. It must be parked.
+// @return void.
+void lwp_unpark(thread t) {
+  if (mn_mode) {
+    fprintf(stderr, "[lwp_unpark] Can't unpark with more than one worker. "
+            "Bailing now...\n");
+    exit(EXIT_FAILURE);
+  }
+
+  crit_enter();
+  t->acct.wakeups++;
+  t->acct.since = acct_now();
+  TRACE(TRACE_WAKE, t, t->acct.since);
+  t->sched_one = NULL;
+  t->sched_two = NULL;
+  lwp_get_scheduler()->admit(t);
+  t->runnable = TRUE;
+  crit_leave();
+}
+
+// Installs the function the scheduler calls to wait for parked threads to be
+// unparked from outside (I/O, for example). When nothing is runnable it is
+// called with how long until the next timer is due (-1: block), and with 0
+// every so often otherwise. It returns FALSE if it has nothing to wait for.
+// @param idle The hook (or NULL).
+// @return void.
+void lwp_set_idle(int (*idle)(long long timeout_ns)) {
+  idle_hook = idle;
+}
+
+
+// Reports how much CPU a thread has had, how long it has waited while
+// runnable, how often it has switched away (by itself, or preempted), and how
+// often it has been woken.
+// @param tid The thread (live, blocked, or exited but not yet reaped).
+// @param out Where to put the stats.
+// @return 0, or -1 if there is no such thread.
+int lwp_stats(tid_t tid, lwp_thread_stats *out) {
+  thread t = tid2thread(tid);
+  if (t == NULL) {
+    return -1;
+  }
+
+  crit_enter();
+  acct_copy(t, out);
+  crit_leave();
+
+  return 0;
+}
+
+// Takes a snapshot of the scheduler's stats (how many decisions it has made
+// and how long they took, how long its queue has been, how long we have sat
+// idle) and of every thread's. The scheduler's stats are only kept by the
+// single-worker runtime.
+// @param sched Where to put the scheduler's stats (or NULL).
+// @param threads Where to put the threads' stats (or NULL).
+// @param max How many threads fit there.
+// @return How many threads there are (which may be more than max).
+int lwp_stats_snapshot(lwp_sched_stats *sched, lwp_thread_stats *threads,
+    int max) {
+  crit_enter();
+  LIB_LOCK();
+
+  int n = 0;
+  thread lists[3] = { live_head, blck_head, term_head };
+  int i;
+  for (i = 0; i < 3; i++) {
+    thread t;
+    for (t = lists[i]; t != NULL; t = t->NEXT) {
+      if (threads != NULL && n < max) {
+        acct_copy(t, &threads[n]);
+      }
+      n++;
+    }
+  }
+
+  if (sched != NULL) {
+    sched->decisions = decisions;
+    sched->decide_ns = acct_ns(decide_ticks) * DECIDE_SAMPLE;
+    sched->decide_max_ns = acct_ns(decide_max);
+    sched->qlen = lwp_get_scheduler()->qlen();
+    sched->qlen_max = qlen_max;
+    sched->qlen_avg = decisions ? (double)qlen_sum / (double)decisions : 0.0;
+    sched->idle_ns = acct_ns(idle_ticks);
+    sched->threads = n;
+  }
+
+  LIB_UNLOCK();
+  crit_leave();
+  return n;
+}
+
+
+// === M:N FUNCTIONS =========================================================
+// Moves every admitted thread onto the WorkStealing deques, runs them on n
+// worker pthreads, and puts the old scheduler back once they have all exited.
+// The calling thread does not become an LWP.
+// @param n The number of workers.
+// @return void.
+static void lwp_run_workers(int n) {
+  scheduler prev = lwp_get_scheduler();
+
+  // Deal the threads out to the workers before any of them are running.
+  ws_setup(n);
+  lwp_set_scheduler(WorkStealing);
+
+  workers = calloc(n, sizeof(worker));
+  if (workers == NULL) {
+    perror("[lwp_run_workers] Error when calloc()ing the workers.");
+    exit(EXIT_FAILURE);
+  }
+
+  mn_mode = TRUE;
+
+  int i;
+  for (i = 0; i < n; i++) {
+    workers[i].id = i;
+    if (pthread_create(&workers[i].pthread, NULL, lwp_worker, &workers[i])) {
+      perror("[lwp_run_workers] Error when creating a worker.");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Each worker leaves once there are no live threads left.
+  for (i = 0; i < n; i++) {
+    pthread_join(workers[i].pthread, NULL);
+  }
+
+  mn_mode = FALSE;
+  free(workers);
+  workers = NULL;
+
+  lwp_set_scheduler(prev);
+  ws_teardown();
+}
+
+// The loop run by each worker. Pick a thread, switch to it, and when it
+// switches back finish whatever it was doing.
+// @param arg The worker this pthread is.
+// @return NULL.
+static void *lwp_worker(void *arg) {
+  worker *w = arg;
+  ws_bind(w->id);
+  me = w;
+
+  // Growable stacks fault on whichever worker runs them.
+  if (stack_initial > 0) {
+    stack_altstack();
+  }
+
+  while (TRUE) {
+    thread next = WorkStealing->next();
+
+    if (next == NULL) {
+      // Nothing to run or steal. Either everyone is done, or the rest are
+      // running on other workers (or blocked), so sleep until a thread is
+      // admitted. We count ourselves idle before looking at the deques
+      // again, and admitters push before they look at the count, so one of
+      // us always sees the other.
+      pthread_mutex_lock(&lib_lock);
+      atomic_fetch_add(&mn_idle, 1);
+      while (live_count != 0 && WorkStealing->qlen() == 0) {
+        pthread_cond_wait(&mn_idle_cond, &lib_lock);
+      }
+      atomic_fetch_sub(&mn_idle, 1);
+      int done = (live_count == 0);
+      pthread_mutex_unlock(&lib_lock);
+
+      if (done) {
+        break;
+      }
+      continue;
+    }
+
+    unsigned long long now = acct_now();
+    next->acct.wait += now - next->acct.since;
+    next->acct.since = now;
+    TRACE(TRACE_IN, next, now);
+
+    curr = next;
+    SWAP_VOLUNTARY(&w->state, &next->state);
+
+    now = acct_now();
+    next->acct.cpu += now - next->acct.since;
+    next->acct.since = now;
+    next->acct.switches++;
+    TRACE(TRACE_OUT, next, now);
+
+    // The thread's registers are saved, so it is now safe for another worker
+    // to pick it up.
+    curr = NULL;
+    lwp_worker_settle(w, next);
+  }
+
+  return NULL;
+}
+
+// Finishes whatever the thread that just switched back to its worker asked
+// for. This is the second half of lwp_yield(), lwp_exit() and lwp_wait().
+// @param w The worker.
+// @param t The thread that switched back.
+// @return void.
+static void lwp_worker_settle(worker *w, thread t) {
+  switch (w->op) {
+    case MN_YIELD:
+      mn_admit(t);
+      break;
+
+    case MN_EXIT:
+      pthread_mutex_lock(&lib_lock);
+      lwp_list_remove(&live_head, &live_tail, t);
+      live_count--;
+      if (live_count == 0) {
+        // Everyone is done: the parked workers can leave.
+        pthread_cond_broadcast(&mn_idle_cond);
+      }
+
+      if (t->detached) {
+        // We are on our own stack, so it can go right away.
+        thread unblocked = NULL;
+        if (blck_head != NULL && live_count == blck_count) {
+          unblocked = blck_head;
+          lwp_list_remove(&blck_head, &blck_tail, unblocked);
+          blck_count--;
+          unblocked->exited = NULL;
+          lwp_list_enqueue(&live_head, &live_tail, unblocked);
+        }
+        pthread_mutex_unlock(&lib_lock);
+
+        lwp_reap(t, NULL);
+        if (unblocked != NULL) {
+          unblocked->acct.wakeups++;
+          unblocked->acct.since = acct_now();
+          TRACE(TRACE_WAKE, unblocked, unblocked->acct.since);
+          mn_admit(unblocked);
+        }
+      }
+      else if (blck_head != NULL) {
+        // Hand the thread straight to the oldest waiter.
+        thread unblocked = blck_head;
+        lwp_list_remove(&blck_head, &blck_tail, unblocked);
+        blck_count--;
+        unblocked->exited = t;
+        t->joiner = unblocked;
+        lwp_list_enqueue(&live_head, &live_tail, unblocked);
+        pthread_mutex_unlock(&lib_lock);
+
+        unblocked->acct.wakeups++;
+        unblocked->acct.since = acct_now();
+        TRACE(TRACE_WAKE, unblocked, unblocked->acct.since);
+        mn_admit(unblocked);
+      }
+      else {
+        lwp_list_enqueue(&term_head, &term_tail, t);
+        pthread_mutex_unlock(&lib_lock);
+      }
+      break;
+
+    case MN_WAIT:
+      pthread_mutex_lock(&lib_lock);
+      if (term_head != NULL) {
+        // Something exited while we were switching; no need to block.
+        t->exited = term_head;
+        term_head->joiner = t;
+        lwp_list_remove(&term_head, &term_tail, term_head);
+        pthread_mutex_unlock(&lib_lock);
+
+        mn_admit(t);
+      }
+      else {
+        lwp_list_remove(&live_head, &live_tail, t);
+        lwp_list_enqueue(&blck_head, &blck_tail, t);
+        blck_count++;
+        pthread_mutex_unlock(&lib_lock);
+      }
+      break;
+  }
+}
+
+// Puts a thread on the calling worker's deque, and wakes a parked worker to
+// steal it (or whatever else this worker has queued).
+// @param t The thread.
+// @return void.
+static void mn_admit(thread t) {
+  WorkStealing->admit(t);
+  mn_wake(FALSE);
+}
+
+// Wakes parked workers, if there are any. The fence orders the push the
+// caller just did before our look at mn_idle (see lwp_worker()).
+// @param all TRUE to wake every parked worker, FALSE for just one.
+// @return void.
+static void mn_wake(int all) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&mn_idle) == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&lib_lock);
+  if (all) {
+    pthread_cond_broadcast(&mn_idle_cond);
+  }
+  else {
+    pthread_cond_signal(&mn_idle_cond);
+  }
+  pthread_mutex_unlock(&lib_lock);
+}
+
+
+// === PREEMPTION FUNCTIONS ==================================================
+// Enters a section the preemption timer must not interrupt. In M:N mode the
+// timer is ignored, so there is nothing to count.
+// @param void.
+// @return void.
+static void crit_enter(void) {
+  if (!mn_mode) {
+    crit++;
+  }
+}
+
+// Leaves a section entered with crit_enter(). Leaving the outermost one runs
+// any tick that was deferred while we were inside.
+// @param void.
+// @return void.
+static void crit_leave(void) {
+  if (mn_mode) {
+    return;
+  }
+
+  crit--;
+  if (crit == 0 && preempt_pending && get_curr() != NULL) {
+    preempt_pending = FALSE;
+    lwp_yield();
+  }
+}
+
+// Switches from old to next. Our crit depth is kept in a local while we are
+// switched out, and put back when somebody switches to us again.
+// @param old The running thread.
+// @param next The thread to run.
+// @param full TRUE to save every register (preemption), FALSE when old is
+// switching voluntarily and only the callee-saved ones matter.
+// @return void.
+static void lwp_switch(thread old, thread next, int full) {
+  sig_atomic_t depth = crit;
+
+  // Old stops running (and, unless it is blocking, starts waiting); next
+  // stops waiting.
+  if (old != next) {
+    unsigned long long now = decided_at;
+    old->acct.cpu += now - old->acct.since;
+    old->acct.since = now;
+    if (full) {
+      old->acct.preempts++;
+    }
+    else {
+      old->acct.switches++;
+    }
+
+    if (now > next->acct.since) {
+      next->acct.wait += now - next->acct.since;
+    }
+    next->acct.since = now;
+
+    TRACE(full ? TRACE_PREEMPT : TRACE_OUT, old, now);
+    TRACE(TRACE_IN, next, now);
+  }
+
+  // Give the next thread a fresh slice.
+  scheduler sched = lwp_get_scheduler();
+  int ticks = (sched->quantum != NULL) ? (int)sched->quantum(next) : 1;
+  slice_left = (ticks < 1) ? 1 : ticks;
+  preempt_pending = FALSE;
+
+  set_curr(next);
+  if (full) {
+    swap_rfiles(&old->state, &next->state);
+  }
+  else {
+    SWAP_VOLUNTARY(&old->state, &next->state);
+  }
+
+  crit = depth;
+  lwp_reap_zombie();
+}
+
+// Charges the running thread one tick, and switches away from it once its
+// slice is used up. If it is inside library code (or a masked section) the
+// switch waits for crit_leave() instead.
+// @param signum The signal number (LWP_TICK_SIGNAL).
+// @return void.
+static void lwp_tick(int signum) {
+  slice_left--;
+
+  // A sleeper whose time is up cuts the slice short, so the scheduler gets a
+  // say without waiting out a long quantum.
+  if (slice_left > 0 && crit == 0 && !mn_mode && lwp_timer_expire() > 0) {
+    slice_left = 0;
+  }
+
+  if (slice_left > 0) {
+    return;
+  }
+
+  thread old = get_curr();
+  if (crit > 0 || mn_mode || old == NULL) {
+    preempt_pending = TRUE;
+    return;
+  }
+
+  crit = 1;
+
+  // The kernel blocks the signal while we're in its handler, and the mask
+  // belongs to the kernel thread, not to us. Unblock it, or whoever we switch
+  // to would never be ticked again. Ticks from here on see crit and wait.
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, LWP_TICK_SIGNAL);
+  sigprocmask(SIG_UNBLOCK, &set, NULL);
+
+  // Through lwp_pick(), so sleepers whose time is up get in even while
+  // nobody yields.
+  thread next = lwp_pick();
+  if (next != NULL) {
+    lwp_switch(old, next, TRUE);
+  }
+
+  crit = 0;
+}
+
+
+// === PARKING FUNCTIONS =====================================================
+// Gets the next thread from the scheduler. Sleepers whose time is up are let
+// back in first, and every LWP_POLL_INTERVAL picks the idle hook gets a
+// non-blocking look. If the scheduler comes up empty, we wait for the next
+// timer in the idle hook (or in the kernel, if the hook has nothing to wait
+// for) until something is unparked. If nothing ever will be, a thread
+// blocked in lwp_wait() is woken to return NO_THREAD.
+// @param void.
+// @return The next thread to run (or NULL if nothing ever will be).
+static thread lwp_pick(void) {
+  scheduler sched = lwp_get_scheduler();
+
+  lwp_poll();
+
+  thread next = lwp_decide(sched);
+  while (next == NULL) {
+    long long wait = lwp_timer_wait_ns();
+    unsigned long long idle_since = acct_now();
+
+    if (idle_hook == NULL || !idle_hook(wait)) {
+      // Nothing armed, and no I/O to wait for: nobody can be woken.
+      if (wait < 0) {
+        break;
+      }
+
+      struct timespec ts;
+      ts.tv_sec = wait / 1000000000LL;
+      ts.tv_nsec = wait % 1000000000LL;
+      nanosleep(&ts, NULL);
+    }
+
+    idle_ticks += acct_now() - idle_since;
+    lwp_timer_expire();
+    next = lwp_decide(sched);
+  }
+
+  // Nothing will ever run again, so nothing can exit for anybody blocked in
+  // lwp_wait() either. The oldest of them gets NO_THREAD.
+  if (next == NULL && blck_head != NULL) {
+    lwp_unblock(NULL);
+    next = lwp_decide(sched);
+  }
+
+  return next;
+}
+
+// Fires any timers that are due, and every LWP_POLL_INTERVAL calls checks
+// the idle hook (without waiting), so their threads are runnable before the
+// next decision.
+// @param void.
+// @return void.
+static void lwp_poll(void) {
+  lwp_timer_expire();
+
+  if (idle_hook != NULL && --poll_countdown <= 0) {
+    poll_countdown = LWP_POLL_INTERVAL;
+    idle_hook(0);
+  }
+}
+
+// Calls the scheduler's next(), counting the decision, how many threads it had
+// to choose from, and (for a sample of them) how long it took.
+// @param sched The scheduler.
+// @return Whatever next() returned.
+static thread lwp_decide(scheduler sched) {
+  int qlen = sched->qlen();
+  qlen_sum += qlen;
+  if (qlen > qlen_max) {
+    qlen_max = qlen;
+  }
+
+  // Only every DECIDE_SAMPLE-th decision is timed: the TSC is read once for
+  // every switch anyway, but twice would double what accounting costs.
+  if (decisions++ % DECIDE_SAMPLE != 0) {
+    thread next = sched->next();
+    decided_at = acct_now();
+    return next;
+  }
+
+  unsigned long long start = acct_now();
+  thread next = sched->next();
+  decided_at = acct_now();
+  unsigned long long took = decided_at - start;
+
+  decide_ticks += took;
+  if (took > decide_max) {
+    decide_max = took;
+  }
+
+  return next;
+}
+
+
+// === ACCOUNTING FUNCTIONS ==================================================
+// Reads the TSC. It is cheaper than clock_gettime() on every switch, and is
+// only turned into nanoseconds when somebody asks.
+// @param void.
+// @return The TSC.
+static unsigned long long acct_now(void) {
+  return __rdtsc();
+}
+
+// Zeroes a new thread's accounting and starts its clock (a new thread is
+// runnable, so it starts out waiting). The first thread also pins down where
+// the TSC and the monotonic clock were at the same moment.
+// @param t The thread.
+// @return void.
+static void acct_init(thread t) {
+  memset(&t->acct, 0, sizeof(t->acct));
+  t->acct.since = acct_now();
+
+  if (tsc_base == 0) {
+    ns_base = lwp_now();
+    tsc_base = acct_now();
+  }
+}
+
+// Converts TSC ticks to nanoseconds at the rate the TSC has run since the
+// first thread started (which gets more exact the longer we run).
+// @param ticks The ticks.
+// @return The nanoseconds (0 if we can't tell yet).
+static unsigned long long acct_ns(unsigned long long ticks) {
+  unsigned long long tsc = acct_now() - tsc_base;
+  long long ns = lwp_now() - ns_base;
+
+  if (tsc_base == 0 || tsc == 0 || ns <= 0) {
+    return 0;
+  }
+  return (unsigned long long)((double)ticks * (double)ns / (double)tsc);
+}
+
+// Copies a thread's accounting out, in nanoseconds. The calling thread's
+// time is counted up to now; anybody else's up to their last switch.
+// @param t The thread.
+// @param out Where to put it.
+// @return void.
+static void acct_copy(thread t, lwp_thread_stats *out) {
+  unsigned long long cpu = t->acct.cpu;
+  if (t == get_curr()) {
+    cpu += acct_now() - t->acct.since;
+  }
+
+  out->tid = t->tid;
+  out->cpu_ns = acct_ns(cpu);
+  out->wait_ns = acct_ns(t->acct.wait);
+  out->switches = t->acct.switches;
+  out->preempts = t->acct.preempts;
+  out->wakeups = t->acct.wakeups;
+}
+
+
+// === TRACE FUNCTIONS =======================================================
+// Starts tracing: from now on, every thread's creation, switches in and out
+// (and whether it was preempted), blocking, waking and exit are kept in an
+// in-memory ring with their times. The ring is written to path as Chrome
+// trace_event JSON (which Perfetto and chrome://tracing load) when the
+// process exits, whenever it gets LWP_TRACE_SIGNAL, or on lwp_trace_dump().
+// Setting LWP_TRACE_ENV to a path does the same from the first lwp_create()
+// or lwp_start(). Calling it again only changes the path.
+// @param path The file to dump to.
+// @return 0, or -1 if path is NULL or the ring can't be allocated.
+int lwp_trace(const char *path) {
+  if (path == NULL) {
+    return -1;
+  }
+
+  char *copy = strdup(path);
+  if (copy == NULL) {
+    perror("[lwp_trace] Error when strdup()ing the path.");
+    return -1;
+  }
+
+  crit_enter();
+  free(trace_path);
+  trace_path = copy;
+
+  if (trace_ring == NULL) {
+    trace_event *ring = calloc(LWP_TRACE_EVENTS, sizeof(trace_event));
+    if (ring == NULL) {
+      perror("[lwp_trace] Error when calloc()ing the trace ring.");
+      crit_leave();
+      return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(LWP_TRACE_SIGNAL, &sa, NULL) == -1) {
+      perror("[lwp_trace] Error when installing the dump handler.");
+    }
+    atexit(trace_atexit);
+
+    trace_ring = ring;
+  }
+
+  crit_leave();
+  return 0;
+}
+
+// Writes the trace ring out now (see lwp_trace()). Only the most recent
+// LWP_TRACE_EVENTS events are still there. Each thread is a track of its own,
+// with a "run" slice for every stretch it ran.
+// @param void.
+// @return How many events were written, or -1 if tracing is off or the file
+// can't be written.
+int lwp_trace_dump(void) {
+  if (trace_ring == NULL || trace_path == NULL) {
+    return -1;
+  }
+
+  trace_out out;
+  out.len = 0;
+  out.fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out.fd == -1) {
+    perror("[lwp_trace_dump] Error when opening the trace file.");
+    return -1;
+  }
+
+  static const char *names[] = { "create", "run", "run", "run", "block",
+    "wake", "exit" };
+  static const char *phases[] = { "i", "B", "E", "E", "i", "i", "i" };
+
+  unsigned long head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+  unsigned long first = (head > LWP_TRACE_EVENTS) ? head - LWP_TRACE_EVENTS : 0;
+  unsigned long long pid = (unsigned long long)getpid();
+  unsigned long i;
+
+  trace_put(&out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for (i = first; i < head; i++) {
+    trace_event *e = &trace_ring[i % LWP_TRACE_EVENTS];
+    unsigned long long ns = (e->tsc > tsc_base) ? acct_ns(e->tsc - tsc_base) : 0;
+
+    if (e->type == TRACE_CREATE) {
+      // Name the thread's track after it.
+      trace_put(&out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":");
+      trace_put_num(&out, pid);
+      trace_put(&out, ",\"tid\":");
+      trace_put_num(&out, e->tid);
+      trace_put(&out, ",\"args\":{\"name\":\"lwp ");
+      trace_put_num(&out, e->tid);
+      trace_put(&out, "\"}},\n");
+    }
+
+    trace_put(&out, "{\"name\":\"");
+    trace_put(&out, names[e->type]);
+    trace_put(&out, "\",\"ph\":\"");
+    trace_put(&out, phases[e->type]);
+    trace_put(&out, (phases[e->type][0] == 'i') ? "\",\"s\":\"t" : "");
+    trace_put(&out, "\",\"pid\":");
+    trace_put_num(&out, pid);
+    trace_put(&out, ",\"tid\":");
+    trace_put_num(&out, e->tid);
+
+    // ts is in microseconds.
+    trace_put(&out, ",\"ts\":");
+    trace_put_num(&out, ns / 1000);
+    trace_put(&out, (ns % 1000 < 100) ? ((ns % 1000 < 10) ? ".00" : ".0") : ".");
+    trace_put_num(&out, ns % 1000);
+
+    if (e->type == TRACE_PREEMPT) {
+      trace_put(&out, ",\"args\":{\"preempted\":1}");
+    }
+    else if (e->type == TRACE_IN && e->worker >= 0) {
+      trace_put(&out, ",\"args\":{\"worker\":");
+      trace_put_num(&out, (unsigned long long)e->worker);
+      trace_put(&out, "}");
+    }
+    trace_put(&out, (i + 1 < head) ? "},\n" : "}\n");
+  }
+  trace_put(&out, "]}\n");
+
+  trace_flush(&out);
+  close(out.fd);
+  return (int)(head - first);
+}
+
+// Turns tracing on if LWP_TRACE_ENV names a file. Only looks once.
+// @param void.
+// @return void.
+static void trace_env(void) {
+  if (trace_checked) {
+    return;
+  }
+  trace_checked = TRUE;
+
+  const char *path = getenv(LWP_TRACE_ENV);
+  if (path != NULL && path[0] != '\0') {
+    lwp_trace(path);
+  }
+}
+
+// Claims the next slot of the ring and fills it in. The oldest event is
+// overwritten once the ring is full.
+// @param type What happened.
+// @param t The thread it happened to.
+// @param tsc When.
+// @return void.
+static void trace_log(trace_type type, thread t, unsigned long long tsc) {
+  unsigned long i = __atomic_fetch_add(&trace_head, 1, __ATOMIC_ACQ_REL);
+  trace_event *e = &trace_ring[i % LWP_TRACE_EVENTS];
+
+  e->tsc = tsc;
+  e->tid = t->tid;
+  e->type = type;
+  e->worker = (me != NULL) ? me->id : -1;
+}
+
+// Dumps the trace as the process exits.
+// @param void.
+// @return void.
+static void trace_atexit(void) {
+  lwp_trace_dump();
+}
+
+// Dumps the trace so far, and carries on.
+// @param signum The signal number (LWP_TRACE_SIGNAL).
+// @return void.
+static void trace_signal(int signum) {
+  lwp_trace_dump();
+}
+
+// Appends a string to the dump, writing the buffer out when it fills.
+// @param out The dump.
+// @param str The string.
+// @return void.
+static void trace_put(trace_out *out, const char *str) {
+  while (*str != '\0') {
+    if (out->len == sizeof(out->buf)) {
+      trace_flush(out);
+    }
+    out->buf[out->len++] = *str++;
+  }
+}
+
+// Appends a number (in decimal) to the dump.
+// @param out The dump.
+// @param n The number.
+// @return void.
+static void trace_put_num(trace_out *out, unsigned long long n) {
+  char digits[21];
+  int i = sizeof(digits) - 1;
+
+  digits[i] = '\0';
+  do {
+    digits[--i] = (char)('0' + n % 10);
+    n /= 10;
+  } while (n != 0);
+
+  trace_put(out, &digits[i]);
+}
+
+// Writes out whatever is buffered.
+// @param out The dump.
+// @return void.
+static void trace_flush(trace_out *out) {
+  size_t done = 0;
+  while (done < out->len) {
+    ssize_t n = write(out->fd, out->buf + done, out->len - done);
+    if (n <= 0) {
+      break;
+    }
+    done += (size_t)n;
+  }
+  out->len = 0;
+}
+
+
+// === STACK FUNCTIONS =======================================================
+// Maps a stack. Normally all of it is readable and writable. A growable stack
+// (see lwp_set_stack_growth()) is reserved with no access at all, and only
+// its top stack_initial bytes are opened up, leaving at least the bottom page
+// as a guard.
+// @param size The size of the stack (a multiple of the page size).
+// @param commit Where to put how much of it is mapped in.
+// @return The stack, or MAP_FAILED.
+static void *stack_map(size_t size, size_t *commit) {
+  if (stack_initial == 0 || size <= page_bytes) {
+    *commit = size;
+    return mmap(NULL, size, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+  }
+
+  void *stack = mmap(NULL, size, PROT_NONE,
+      MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK|MAP_NORESERVE, -1, 0);
+  if (stack == MAP_FAILED) {
+    return MAP_FAILED;
+  }
+
+  size_t initial = (stack_initial < size - page_bytes) ?
+    stack_initial : size - page_bytes;
+  if (mprotect((char *)stack + size - initial, initial,
+        PROT_READ|PROT_WRITE) == -1) {
+    munmap(stack, size);
+    return MAP_FAILED;
+  }
+
+  *commit = initial;
+  return stack;
+}
+
+// Maps n stacks as one mapping, to be carved into slots of size bytes, each
+// of which can be unmapped on its own later. Like lwp_create()'s stacks, a
+// slot has no guard page of its own, so the whole batch is one mmap() and
+// one mapping. Growable stacks (see stack_map()) are reserved without being
+// charged for, and only the top of each is opened up; the rest are charged
+// like any other stack.
+// @param size The size of a stack.
+// @param n How many stacks.
+// @param commit Where to put how much of each stack is mapped in.
+// @return The lowest stack, or MAP_FAILED.
+static void *stack_map_many(size_t size, int n, size_t *commit) {
+  int i;
+
+  if (page_bytes == 0) {
+    page_bytes = sysconf(_SC_PAGE_SIZE);
+  }
+
+  int grow = (stack_initial != 0 && size > page_bytes);
+  *commit = size;
+  if (grow) {
+    *commit = (stack_initial < size - page_bytes) ?
+      stack_initial : size - page_bytes;
+  }
+
+  if (n <= 0 || (size_t)n > SIZE_MAX / size) {
+    errno = ENOMEM;
+    return MAP_FAILED;
+  }
+
+  size_t bytes = (size_t)n * size;
+  char *map = mmap(NULL, bytes, grow ? PROT_NONE : PROT_READ|PROT_WRITE,
+      MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK|(grow ? MAP_NORESERVE : 0), -1, 0);
+  if (map == MAP_FAILED || !grow) {
+    return map;
+  }
+
+  for (i = 0; i < n; i++) {
+    char *top = map + (size_t)(i + 1) * size;
+    if (mprotect(top - *commit, *commit, PROT_READ|PROT_WRITE) == -1) {
+      munmap(map, bytes);
+      return MAP_FAILED;
+    }
+  }
+
+  return map;
+}
+
+// Fills the top of a new thread's stack (as much as stack_watch asks for, and
+// is mapped in) with STACK_PAINT_WORD. Only the frame lwp_create() built is
+// above it, so that counts as used.
+// @param t The thread.
+// @return void.
+static void stack_paint(thread t) {
+  size_t paint = stack_watch & ~(sizeof(unsigned long) - 1);
+  if (paint > t->stackcommit) {
+    paint = t->stackcommit;
+  }
+
+  unsigned long *top = (unsigned long *)((char *)t->stack + t->stacksize);
+  unsigned long *word;
+  for (word = top - paint / sizeof(unsigned long); word < top; word++) {
+    *word = STACK_PAINT_WORD;
+  }
+
+  t->stackpaint = paint;
+}
+
+// Scans a painted stack up from the bottom of the paint for the first word
+// that was written over.
+// @param t The thread.
+// @return How far below the top that word is, in bytes (the whole paint if
+// the lowest word is gone, which means it may have gone deeper).
+static size_t stack_depth(thread t) {
+  unsigned long *top = (unsigned long *)((char *)t->stack + t->stacksize);
+  unsigned long *word = top - t->stackpaint / sizeof(unsigned long);
+
+  while (word < top && *word == STACK_PAINT_WORD) {
+    word++;
+  }
+  return (size_t)((char *)top - (char *)word);
+}
+
+// Adds a thread's depth to the record for its entry function.
+// @param t The thread (about to be freed).
+// @return void.
+static void stack_record(thread t) {
+  size_t depth = stack_depth(t);
+
+  pthread_mutex_lock(&stack_lock);
+
+  stack_usage *u;
+  for (u = stack_usages; u != NULL; u = u->next) {
+    if (u->usage.fun == t->entry) {
+      break;
+    }
+  }
+
+  if (u == NULL) {
+    u = calloc(1, sizeof(stack_usage));
+    if (u == NULL) {
+      perror("[stack_record] Error when calloc()ing a record.");
+      pthread_mutex_unlock(&stack_lock);
+      return;
+    }
+    u->usage.fun = t->entry;
+    u->next = stack_usages;
+    stack_usages = u;
+  }
+
+  u->usage.threads++;
+  u->usage.total += depth;
+  if (depth > u->usage.max) {
+    u->usage.max = depth;
+  }
+  if (depth == t->stackpaint) {
+    u->usage.overflows++;
+  }
+
+  pthread_mutex_unlock(&stack_lock);
+}
+
+// Gives the calling pthread an alternate signal stack for the fault handler,
+// unless it has one.
+// @param void.
+// @return 0, or -1 if it can't.
+static int stack_altstack(void) {
+  if (altstack != NULL) {
+    return 0;
+  }
+
+  stack_t ss;
+  ss.ss_sp = malloc(LWP_ALTSTACK_SIZE);
+  if (ss.ss_sp == NULL) {
+    perror("[stack_altstack] Error when malloc()ing an alternate stack.");
+    return -1;
+  }
+  ss.ss_size = LWP_ALTSTACK_SIZE;
+  ss.ss_flags = 0;
+
+  if (sigaltstack(&ss, NULL) == -1) {
+    perror("[stack_altstack] Error when setting the alternate stack.");
+    free(ss.ss_sp);
+    return -1;
+  }
+
+  altstack = ss.ss_sp;
+  return 0;
+}
+
+// The SIGSEGV handler. If the fault is in the unmapped part of the running
+// thread's stack, above the guard page, maps in enough to cover it (at least
+// doubling what is there, up to the cap) and returns to retry the access.
+// Anything else is a real fault: the default action is put back, so
+// returning faults again and kills the process as usual.
+// @param signum The signal number (SIGSEGV).
+// @param info Where the fault was.
+// @param uctx Unused.
+// @return void.
+static void stack_fault(int signum, siginfo_t *info, void *uctx) {
+  thread t = get_curr();
+  char *addr = info->si_addr;
+
+  if (t != NULL && t->stack != NULL && t->stackcommit < t->stacksize) {
+    char *base = (char *)t->stack;
+    char *top = base + t->stacksize;
+    char *mapped = top - t->stackcommit;
+
+    if (addr >= base + page_bytes && addr < mapped) {
+      size_t need = top - (char *)((uintptr_t)addr & ~(page_bytes - 1));
+      size_t grow = 2 * t->stackcommit;
+      if (grow < need) {
+        grow = need;
+      }
+      if (grow > t->stacksize - page_bytes) {
+        grow = t->stacksize - page_bytes;
+      }
+
+      if (mprotect(top - grow, grow - t->stackcommit,
+            PROT_READ|PROT_WRITE) == 0) {
+        t->stackcommit = grow;
+        return;
+      }
+    }
+    else if (addr >= base && addr < mapped) {
+      static const char msg[] = "[stack_fault] LWP stack overflow.\n";
+      write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    }
+  }
+
+  signal(SIGSEGV, SIG_DFL);
+}
+
+
+// === SLAB FUNCTIONS ========================================================
+// Takes a context off the free list, mapping a fresh slab first if the list
+// is empty.
+// @param void.
+// @return The context, or NULL if no slab could be mapped.
+static thread ctx_alloc(void) {
+  LIB_LOCK();
+  thread t = slab_alloc(&ctx_slabs);
+  LIB_UNLOCK();
+
+  return t;
+}
+
+// Puts a context back on the front of the free list, so the next thread
+// created gets the one that is still in the cache.
+// @param t The thread. It must not be on any list.
+// @return void.
+static void ctx_free(thread t) {
+  LIB_LOCK();
+  slab_free(&ctx_slabs, t);
+  LIB_UNLOCK();
+}
+
+// Sizes the context class's slots: a context, rounded up to whole cache
+// lines.
+// @param void.
+// @return void.
+static void slab_setup(void) {
+  ctx_slabs.stride = (sizeof(context) + CACHE_LINE - 1) &
+    ~(size_t)(CACHE_LINE - 1);
+}
+
+// Takes the first slot off a class's free list, mapping a slab first if it
+// is empty. The caller holds LIB_LOCK().
+// @param c The class.
+// @return The slot, or NULL if no slab could be mapped.
+static void *slab_alloc(slab_class *c) {
+  if (c->free == NULL && slab_reserve(c, 1) == -1) {
+    return NULL;
+  }
+
+  void *slot = c->free;
+  c->free = *(void **)slot;
+  c->count--;
+  return slot;
+}
+
+// Puts a slot back on the front of its class's free list. The caller holds
+// LIB_LOCK().
+// @param c The class.
+// @param slot The slot.
+// @return void.
+static void slab_free(slab_class *c, void *slot) {
+  *(void **)slot = c->free;
+  c->free = slot;
+  c->count++;
+}
+
+// Maps one slab with whatever a class is missing of n free slots (and at
+// least SLAB_BYTES), and puts its slots on the free list in address order.
+// The caller holds LIB_LOCK().
+// @param c The class.
+// @param n How many free slots it must have.
+// @return 0, or -1 if mmap() failed.
+static int slab_reserve(slab_class *c, size_t n) {
+  pthread_once(&slab_once, slab_setup);
+  if (c->count >= n) {
+    return 0;
+  }
+
+  size_t bytes = (n - c->count) * c->stride;
+  if (bytes < SLAB_BYTES) {
+    bytes = SLAB_BYTES;
+  }
+
+  char *slab = mmap(NULL, bytes, PROT_READ|PROT_WRITE,
+      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (slab == MAP_FAILED) {
+    return -1;
+  }
+
+  // Push them last to first, so they come off first to last.
+  size_t slots = bytes / c->stride;
+  size_t i;
+  for (i = slots; i > 0; i--) {
+    void *slot = slab + (i - 1) * c->stride;
+    *(void **)slot = c->free;
+    c->free = slot;
+  }
+  c->count += slots;
+
+  return 0;
+}
+
+
+// === KEY FUNCTIONS =========================================================
+// Makes a key every thread can keep a value of its own under (NULL until it
+// sets one). The first LWP_KEYS_INLINE keys are kept in the context itself;
+// the rest in a table the thread allocates the first time it sets one.
+// @param key Where to put the key.
+// @param destructor Called with a thread's value (if it isn't NULL) when it
+// exits, or NULL.
+// @return 0, or -1 if there are already LWP_KEYS_MAX keys.
+int lwp_key_create(lwp_key *key, void (*destructor)(void *)) {
+  int ret = 0;
+
+  crit_enter();
+  LIB_LOCK();
+  if (key_count == LWP_KEYS_MAX) {
+    ret = -1;
+  }
+  else {
+    key_dtors[key_count] = destructor;
+    *key = key_count;
+    key_count++;
+  }
+  LIB_UNLOCK();
+  crit_leave();
+
+  return ret;
+}
+
+// Sets the calling thread's value for a key.
+// @param key The key.
+// @param value The value.
+// @return 0, or -1 if the key is bad, the caller isn't an LWP, or there is no
+// memory for the overflow table.
+int lwp_setspecific(lwp_key key, const void *value) {
+  thread self = get_curr();
+  if (self == NULL || key >= key_count) {
+    return -1;
+  }
+
+  if (key < LWP_KEYS_INLINE) {
+    self->specific[key] = (void *)value;
+    return 0;
+  }
+
+  if (self->specific_more == NULL) {
+    // Don't get preempted while holding malloc()'s locks.
+    crit_enter();
+    self->specific_more = calloc(LWP_KEYS_MAX - LWP_KEYS_INLINE,
+        sizeof(void *));
+    crit_leave();
+
+    if (self->specific_more == NULL) {
+      perror("[lwp_setspecific] Error when calloc()ing the overflow table.");
+      return -1;
+    }
+  }
+
+  self->specific_more[key - LWP_KEYS_INLINE] = (void *)value;
+  return 0;
+}
+
+// Gets the calling thread's value for a key.
+// @param key The key.
+// @return The value, or NULL if it hasn't set one (or the key is bad, or the
+// caller isn't an LWP).
+void *lwp_getspecific(lwp_key key) {
+  thread self = get_curr();
+  if (self == NULL) {
+    return NULL;
+  }
+
+  if (key < LWP_KEYS_INLINE) {
+    return self->specific[key];
+  }
+
+  if (key >= LWP_KEYS_MAX || self->specific_more == NULL) {
+    return NULL;
+  }
+  return self->specific_more[key - LWP_KEYS_INLINE];
+}
+
+// Calls the destructor of each key the thread has a value for, clearing the
+// value first. A destructor may set values again, so this goes round again
+// (up to LWP_KEY_ROUNDS times) until a round calls none. Then the overflow
+// table is freed.
+// @param t The thread (the one exiting).
+// @return void.
+static void key_destroy(thread t) {
+  int round;
+  unsigned int key;
+
+  for (round = 0; round < LWP_KEY_ROUNDS; round++) {
+    int called = FALSE;
+
+    for (key = 0; key < key_count; key++) {
+      void **slot;
+      if (key < LWP_KEYS_INLINE) {
+        slot = &t->specific[key];
+      }
+      else if (t->specific_more != NULL) {
+        slot = &t->specific_more[key - LWP_KEYS_INLINE];
+      }
+      else {
+        break;
+      }
+
+      void *value = *slot;
+      if (value != NULL && key_dtors[key] != NULL) {
+        *slot = NULL;
+        key_dtors[key](value);
+        called = TRUE;
+      }
+    }
+
+    if (!called) {
+      break;
+    }
+  }
+
+  crit_enter();
+  free(t->specific_more);
+  t->specific_more = NULL;
+  crit_leave();
+}
+
+
+// === QUEUE HELPER FUNCTIONS ================================================
+// Append the new thread to the end of a given list.
+// For the termiated queue and blocked queue this function abides by the FIFO 
+// requirements. As for the list of all running threads, the order in which 
+// threads are added does not matter.
+// WARNING: Make sure head and tail represent the same list. If not, bad things
+// are going to happen...
+// @param head A pointer to the global head of the list.
+// @param tail A pointer to the global tail of the list.
+// @param new The new thread to be added.
+// @return void.
+static void lwp_list_enqueue(thread *head, thread *tail, thread new) {
+  if (new == NULL) {
+    // This should never happen. Please always call this with a valid 
+    // non-NULL thead.
+    perror("[lwp_list_enqueue] thread new cannot be NULL");
+    exit(EXIT_FAILURE);
+  }
+
+  if ((*head == NULL) ^ (*tail == NULL)) {
+    // This should never happen. Either they are both NULL, or both something.
+    // If this occurs, then someone has made a big mistake. 
+    perror("[lwp_list_enqueue] mismatching tail and head pointers");
+    exit(EXIT_FAILURE);
+  }
+  
+  // There is nothing in the list, so add it and set the head/tail to the same
+  // thread, updating their next and prev pointers.
+  if (*head == NULL && *tail == NULL) {
+    new->NEXT = NULL;
+    new->PREV = NULL;
+
+    *head = new;
+    *tail = new;
+    return;
+  }
+
+  // Otherwise, enqueue to the back of the line (at the tail) as normal.
+  new->NEXT = NULL;
+  new->PREV = *tail;
+  
+  // Set the tail's next value to point to the new thread.
+  (*tail)->NEXT = new;
+  
+  // Set the value at this address to new.
+  *tail = new;
+}
+
+// Remove a thread from either the queue of termiated threads, the queue of 
+// blocked threads, or the doubly linked list of live threads. 
+// To dequeue properly, call lwp_list_remove(head, tail, head)
+// @param head A pointer to the global head of the list.
+// @param tail A pointer to the global tail of the list.
+// @param new The new thread to be added.
+// @return void.
+static void lwp_list_remove(thread *head, thread *tail, thread victim) {
+  if (victim == NULL) {
+    // This should never happen. Please always call this with a valid 
+    // non-NULL thead.
+    perror("[lwp_list_remove] thread victim cannot be NULL");
+    exit(EXIT_FAILURE);
+  }
+
+  if ((*head == NULL) ^ (*tail == NULL)) {
+    // This should never happen. Either they are both NULL, or both something.
+    // If this occurs, then someone has made a big mistake.
+    perror("[lwp_list_dequeue] mismatching tail and head pointers");
     exit(EXIT_FAILURE);
   }
 
@@ -564,9 +2619,186 @@ static void lwp_list_remove(thread *head, thread *tail, thread victim) {
 // @param arg The void* that will be the arguments for the lwpfun
 // @return void.
 static void lwp_wrap(lwpfun fun, void *arg) {
+  // We got here through lwp_switch(), but never return into it, so nothing
+  // else will reset the depth (or clean up after the last thread) for us.
+  crit = 0;
+  crit_enter();
+  lwp_reap_zombie();
+  crit_leave();
+
   lwp_exit(fun(arg));
 }
 
+// Builds a new thread's first stack frame, so the first switch to it
+// "returns" into lwp_trampoline(), which calls lwp_wrap(function, argument).
+// Its stack must already be mapped.
+// @param new The thread.
+// @param function The lwpfun it will execute.
+// @param argument Its argument.
+// @return void.
+static void lwp_frame(thread new, lwpfun function, void *argument) {
+  // Virual Stack Creation
+  // This is where a lot of the magic happens. This allows for the this to be
+  // "returned to", allowing for the instruction pointer to go to the function
+  // we really want to be executed, with the correct arguments.
+
+  // This is the reall "bottom" of the virtual stack. It is the highest address
+  // in our mmap()ed space, and it will grow towards the lower addresses.
+  uintptr_t *stack = (uintptr_t*)((char *)new->stack + new->stacksize);
+
+  // Offset the address we will put lwp_wrap to a multuple of the
+  // BYTE_STACK_ALIGNMENT. All stack frames must be built on that boundary.
+  stack = stack - (uintptr_t)(BYTE_STACK_ALIGNMENT);
+
+  // Fill in the return address (lwp_trampoline); where we will go. It calls
+  // lwp_wrap with the registers filled in below.
+  *stack = (uintptr_t)lwp_trampoline;
+
+  // Make room for the base pointer. (Contents don't matter).
+  stack--;
+
+  // Filling in the Registers
+  // Stack now points to where the base pointer will be.
+  new->state.rbp = (unsigned long)stack;
+
+  // Rsp doesn't matter... we will just point it to the same spot.
+  // This will return to the stackframe we just set to lwp_wait.
+  new->state.rsp = (unsigned long)stack;
+
+  // The fast switch doesn't load rdi/rsi, so lwp_trampoline moves the
+  // arguments there from callee-saved registers before jumping to lwp_wrap.
+  // First argument (lwpfun) - the function
+  new->state.r12 = (unsigned long)function;
+
+  // Second argument (void*) - the argument
+  new->state.r13 = (unsigned long)argument;
+
+  // Where the trampoline jumps.
+  new->state.r14 = (unsigned long)lwp_wrap;
+
+  // Floating point control words, the way a fresh process has them.
+  new->state.mxcsr = MXCSR_DEFAULT;
+  new->state.fcw = FCW_DEFAULT;
+}
+
+// Gives a new thread its id and the rest of its fields, and puts it on the
+// live list. The caller holds LIB_LOCK().
+// @param new The thread.
+// @return void.
+static void lwp_register(thread new) {
+  // Create a new id (just incrementing a counter).
+  new->tid = tid_counter;
+  tid_counter++; 
+
+  // Indicate that it is a live and running process.
+  new->status = LWP_LIVE;
+
+  // For sanity these are all set to NULL. This is a habbit I picked up for 
+  // debugging.
+  new->lib_one = NULL;
+  new->lib_two = NULL;
+  new->sched_one = NULL;
+  new->sched_two = NULL;
+  new->exited = NULL;
+  new->wait_next = NULL;
+  new->joiner = NULL;
+  new->detached = FALSE;
+  memset(new->sched_data, 0, sizeof(new->sched_data));
+  new->tickets = 0;
+  memset(new->specific, 0, sizeof(new->specific));
+  new->specific_more = NULL;
+  acct_init(new);
+  TRACE(TRACE_CREATE, new, acct_now());
+  
+  // Add this to the global list of live threads. The order doesn't matter: I 
+  // put them on the back of the list.
+  lwp_list_enqueue(&live_head, &live_tail, new);
+  live_count++;
+  tid_cache[new->tid & (TID_CACHE_SIZE - 1)] = new;
+}
+
+// Frees a terminated thread's stack and context.
+// @param t The thread. It must not be on any list.
+// @param status Where to put its termination status (or NULL).
+// @return Its tid.
+static tid_t lwp_reap(thread t, int *status) {
+  if (t->stackpaint > 0) {
+    stack_record(t);
+  }
+
+  LIB_LOCK();
+  if (tid_cache[t->tid & (TID_CACHE_SIZE - 1)] == t) {
+    tid_cache[t->tid & (TID_CACHE_SIZE - 1)] = NULL;
+  }
+  LIB_UNLOCK();
+
+  // The original thread runs on the process's own stack.
+  if (t->stack != NULL && munmap(t->stack, t->stacksize) == -1) {
+    // Something terribly wrong has happened. This syscall failed, so we
+    // note the error and give up. In prod, we might try to limp along, but
+    // for now, we are just bailing. 
+    perror("[lwp_reap] Error munmapping lwp! Bailing now...");
+    exit(EXIT_FAILURE);
+  }
+
+  // The parameter status can be null. Don't try to dereference a NULL pointer.
+  if (status != NULL) {
+    *status = t->status;
+  }
+
+  // Save the id because we are going to free the thread soon.
+  tid_t id = t->tid;
+
+  // Give the thread's context back to its slab.
+  ctx_free(t);
+
+  return id;
+}
+
+// Frees the detached thread lwp_exit() left behind, if there is one. We are
+// off its stack by now.
+// @param void.
+// @return void.
+static void lwp_reap_zombie(void) {
+  if (zombie != NULL) {
+    thread z = zombie;
+    zombie = NULL;
+    lwp_reap(z, NULL);
+  }
+}
+
+// Wakes the oldest thread blocked in lwp_wait(), handing it a terminated
+// thread to reap (or NULL, for nothing). Single worker only.
+// @param exited The thread.
+// @return void.
+static void lwp_unblock(thread exited) {
+  // Get the oldest blocked thread that is waiting for a process to end.
+  thread unblocked = blck_head;
+
+  // Remove it from the blocked queue.
+  lwp_list_remove(&blck_head, &blck_tail, unblocked);
+  blck_count--;
+
+  unblocked->exited = exited;
+  if (exited != NULL) {
+    // It's spoken for: lwp_join() and lwp_detach() must leave it alone.
+    exited->joiner = unblocked;
+  }
+  unblocked->acct.wakeups++;
+  unblocked->acct.since = acct_now();
+  TRACE(TRACE_WAKE, unblocked, unblocked->acct.since);
+
+  unblocked->sched_one = NULL;
+  unblocked->sched_two = NULL;
+
+  // Add the unblocked thread to the scheduler again.
+  lwp_get_scheduler()->admit(unblocked);
+  unblocked->runnable = TRUE;
+
+  // Add it back to the live pool.
+  lwp_list_enqueue(&live_head, &live_tail, unblocked);
+}
+
 // Gets the size of the stack that we should use for each thread's virtual
 // stack. If any of the system calls error, then the return value is 0, and 
 // should be handled in function who called get_stacksize()
@@ -605,3 +2837,24 @@ static size_t get_stacksize(void) {
   // Return the limit rounded to the nearest page_size.
   return (size_t)((uintptr_t)limit + ((uintptr_t)page_size - remainder));
 }
+
+// Returns the thread running on this pthread.
+// @param void.
+// @return The current thread (or NULL).
+static thread get_curr(void) {
+  return curr;
+}
+
+// Sets the thread running on this pthread.
+// @param t The thread.
+// @return void.
+static void set_curr(thread t) {
+  curr = t;
+}
+
+// Returns the worker this pthread is.
+// @param void.
+// @return The worker (or NULL outside of M:N mode).
+static worker *get_me(void) {
+  return me;
+}
@@ -30,7 +30,9 @@ registers {
   unsigned long r13;
   unsigned long r14;
   unsigned long r15;
-  struct fxsave fxsave;   /* space to save floating point state */
+  uint32_t mxcsr;               /* saved by every switch; the rest of the */
+  uint16_t fcw;                 /* FPU is saved by the kernel's signal    */
+                                /* frame when a thread is preempted       */
 } rfile;
 #else
   #error "This only works on x86_64 for now"
@@ -39,6 +41,23 @@ registers {
 typedef unsigned long tid_t;
 #define NO_THREAD 0             /* an always invalid thread id */
 
+/* what the library counts for each thread (read it with lwp_stats()) */
+typedef struct lwp_acct {
+  unsigned long long cpu;       /* TSC ticks spent running          */
+  unsigned long long wait;      /* ...and runnable but not running  */
+  unsigned long long since;     /* TSC at the last change of state  */
+  unsigned long      switches;  /* voluntary switches away          */
+  unsigned long      preempts;  /* involuntary ones                 */
+  unsigned long      wakeups;   /* times made runnable again        */
+} lwp_acct;
+
+struct lwp_gen;
+
+/* thread-specific data (see lwp_key_create()) */
+#define LWP_KEYS_INLINE 8       /* values kept in the context itself    */
+#define LWP_KEYS_MAX    256     /* keys there can be, all told          */
+typedef unsigned int lwp_key;
+
 typedef struct threadinfo_st *thread;
 typedef struct threadinfo_st {
   tid_t         tid;            /* lightweight process id  */
@@ -51,6 +70,25 @@ typedef struct threadinfo_st {
   thread        sched_one;      /* Two more for            */
   thread        sched_two;      /* schedulers to use       */
   thread        exited;         /* and one for lwp_wait()  */
+  thread        wait_next;      /* link while parked on a  */
+                                /* wait queue (lwp_park()) */
+  thread        joiner;         /* lwp_join()/lwp_wait()   */
+                                /* that has claimed it     */
+  unsigned int  detached;       /* freed at exit           */
+  long long     sched_data[4];  /* scratch for schedulers  */
+                                /* (zeroed at creation)    */
+  lwp_acct      acct;           /* for lwp_stats()         */
+  size_t        stackcommit;    /* how much of the stack   */
+                                /* is mapped in (growable) */
+  size_t        stackpaint;     /* how much of it was      */
+                                /* painted (watched)       */
+  int         (*entry)(void *); /* the function it runs    */
+  struct lwp_gen *gen;          /* generator it is inside  */
+  unsigned int  runnable;       /* admitted to the sched.  */
+  unsigned int  tickets;        /* Stride's share (0: its  */
+                                /* default)                */
+  void         *specific[LWP_KEYS_INLINE]; /* key values   */
+  void        **specific_more;  /* the rest (or NULL)      */
 } context;
 
 typedef int (*lwpfun)(void *);  /* type for lwp function */
@@ -63,18 +101,85 @@ typedef struct scheduler {
   void   (*remove)(thread victim); /* remove a thread from the pool */
   thread (*next)(void);            /* select a thread to schedule   */
   int    (*qlen)(void);            /* number of ready threads       */
+  unsigned int (*quantum)(thread next); /* slice in ticks (optional)  */
+  void   (*picked)(thread next);   /* lwp_yield_to() chose it (opt.) */
 } *scheduler;
 
 /* lwp functions */
 extern tid_t lwp_create(lwpfun,void *);
+extern int   lwp_create_many(lwpfun fun, void **args, int n, tid_t *tids);
 extern void  lwp_exit(int status);
 extern tid_t lwp_gettid(void);
 extern void  lwp_yield(void);
+extern void  lwp_yield_to(tid_t tid);
 extern void  lwp_start(void);
 extern tid_t lwp_wait(int *);
 extern void  lwp_set_scheduler(scheduler fun);
 extern scheduler lwp_get_scheduler(void);
 extern thread tid2thread(tid_t tid);
+extern tid_t lwp_join(tid_t tid, int *status);
+extern int   lwp_detach(tid_t tid);
+extern void  lwp_set_workers(int n);
+extern int   lwp_set_stack_growth(size_t initial);
+extern int   lwp_reserve(size_t n);
+
+/* preemption (single worker only) */
+extern void  lwp_set_quantum(unsigned long usec);
+extern void  lwp_preempt_disable(void);
+extern void  lwp_preempt_enable(void);
+
+/* for building blocking primitives on the library (single worker only) */
+extern thread lwp_self(void);
+extern void  lwp_park(void);
+extern void  lwp_unpark(thread t);
+extern void  lwp_set_idle(int (*idle)(long long timeout_ns));
+
+/* statistics */
+typedef struct lwp_thread_stats {
+  tid_t              tid;
+  unsigned long long cpu_ns;        /* time running                     */
+  unsigned long long wait_ns;       /* time runnable but not running    */
+  unsigned long      switches;      /* voluntary switches away          */
+  unsigned long      preempts;      /* involuntary switches away        */
+  unsigned long      wakeups;       /* times unparked or unblocked      */
+} lwp_thread_stats;
+
+typedef struct lwp_sched_stats {    /* (single worker only)             */
+  unsigned long      decisions;     /* calls to the scheduler's next()  */
+  unsigned long long decide_ns;     /* time spent in them               */
+  unsigned long long decide_max_ns; /* the longest one                  */
+  int                qlen;          /* runnable threads now             */
+  int                qlen_max;      /* most seen at a decision          */
+  double             qlen_avg;      /* average seen at a decision       */
+  unsigned long long idle_ns;       /* time with nothing to run         */
+  int                threads;       /* threads not yet reaped           */
+} lwp_sched_stats;
+
+extern int   lwp_stats(tid_t tid, lwp_thread_stats *out);
+extern int   lwp_stats_snapshot(lwp_sched_stats *sched,
+                                lwp_thread_stats *threads, int max);
+
+/* stack high-water marks, by entry function (see lwp_stack_watch()) */
+typedef struct lwp_stack_usage {
+  lwpfun             fun;           /* entry function                   */
+  unsigned long      threads;       /* reaped threads that ran it       */
+  size_t             max;           /* deepest any of them went (bytes) */
+  size_t             total;         /* all of their depths, added up    */
+  unsigned long      overflows;     /* went past what was painted       */
+} lwp_stack_usage;
+
+extern void  lwp_stack_watch(size_t paint);
+extern long  lwp_stack_used(tid_t tid);
+extern int   lwp_stack_report(lwp_stack_usage *out, int max);
+
+/* thread-specific data: one value per key per thread, destructors at exit */
+extern int   lwp_key_create(lwp_key *key, void (*destructor)(void *));
+extern int   lwp_setspecific(lwp_key key, const void *value);
+extern void *lwp_getspecific(lwp_key key);
+
+/* tracing: a Chrome trace_event timeline (or set LWP_TRACE=file) */
+extern int   lwp_trace(const char *path);
+extern int   lwp_trace_dump(void);
 
 /* for lwp_wait */
 #define TERMOFFSET        8
@@ -86,5 +191,7 @@ extern thread tid2thread(tid_t tid);
 
 /* prototypes for asm functions */
 void swap_rfiles(rfile *old, rfile *new);
+void swap_rfiles_fast(rfile *old, rfile *new); /* callee-saved regs only */
+void lwp_trampoline(void);                     /* where new threads start */
 
 #endif
@@ -0,0 +1 @@
+./../src/lwptimer.c
\ No newline at end of file
@@ -0,0 +1 @@
+./../include/lwptimer.h
\ No newline at end of file
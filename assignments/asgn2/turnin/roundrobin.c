@@ -19,8 +19,10 @@ static void rr_admit(thread new);
 static void rr_remove(thread victim);
 // Gets the next thread in line (round robin style).
 static thread rr_next(void);
-// Calculates the length of the scheduler.
+// Gets the length of the scheduler.
 static int rr_qlen(void);
+// Carries on from a thread lwp_yield_to() picked.
+static void rr_picked(thread next);
 
 
 // === GLOBAL VARIABLES ======================================================
@@ -31,7 +33,8 @@ static struct scheduler rr_publish = {
   .admit=rr_admit, 
   .remove=rr_remove, 
   .next=rr_next, 
-  .qlen=rr_qlen
+  .qlen=rr_qlen,
+  .picked=rr_picked
 };
 
 // The global RoundRobin pointer that will be referenced.
@@ -43,6 +46,10 @@ static thread head = NULL;
 // The current thread that the scheduler is processing.
 static thread curr = NULL;
 
+// How many threads are in the list. The library samples qlen() on every
+// scheduling decision, so it is kept rather than counted.
+static int count = 0;
+
 
 // === SCHEDULER FUNCTIONS ===================================================
 // Add the passed context to the scheduler's scheduling pool. For round robin,
@@ -50,6 +57,8 @@ static thread curr = NULL;
 // @param new The new thread that is going to be added to the pool.
 // @return void.
 void rr_admit(thread new) {
+  count++;
+
   // If there is currently nothing in the list, set both the head and the tail
   // to the new thread
   if (head == NULL) {
@@ -85,6 +94,8 @@ void rr_admit(thread new) {
 // @param victim The thread we are removing from the schedulers pool.
 // @return void.
 void rr_remove(thread victim) {
+  count--;
+
   // If the victim happens to be the only one in the list, then just remove
   // the head and current threads, setting them to NULL.
   if (victim->NEXT == victim) {
@@ -141,21 +152,14 @@ thread rr_next(void) {
 // @param void.
 // @return int The number of threads in our scheduling pool.
 int rr_qlen(void) {
-  // If there is no head, then there are no threads present.
-  if (head == NULL)  {
-    return 0;
-  }
-
-  // Start the counting at the head of the list.
-  int count = 1;
-  thread next = head->NEXT;
-
-  // Keep on walking though the list while counting until you make it back 
-  // to the head again (this is a circular-doubly-linked-list)
-  while(next != head) {
-    next = next->NEXT;
-    count++;
-  }
-
   return count;
 }
+
+// A thread was run out of turn (by lwp_yield_to()). The rotation carries on
+// from it, as if next() had just returned it, so it doesn't get a second turn
+// straight after this one.
+// @param next The thread being run.
+// @return void.
+void rr_picked(thread next) {
+  curr = next->NEXT;
+}
@@ -0,0 +1 @@
+./../src/workstealing.c
\ No newline at end of file
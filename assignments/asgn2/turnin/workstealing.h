@@ -0,0 +1 @@
+./../include/workstealing.h
\ No newline at end of file